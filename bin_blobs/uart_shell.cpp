@@ -1,5 +1,6 @@
 #include <arm_acle.h>
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 
@@ -48,6 +49,9 @@ constexpr ArmSR ACTLR{15, 0, 1, 0, 1};
 constexpr ArmSR VBAR{15, 0, 12, 0, 0};
 constexpr ArmSR DFSR{15, 0, 5, 0, 0};
 constexpr ArmSR DFAR{15, 0, 6, 0, 0};
+constexpr ArmSR PMCR{15, 0, 9, 12, 0};
+constexpr ArmSR PMCNTENSET{15, 0, 9, 12, 1};
+constexpr ArmSR PMCCNTR{15, 0, 9, 13, 0};
 
 constexpr inline void arm_dsb() {
   asm volatile("dsb" ::: "memory");
@@ -67,6 +71,268 @@ constexpr inline void arm_wsr(const ArmSR& sr, u32 value) {
   arm_isb();
 }
 
+// Bulk memory ops for the host to run on target instead of streaming the data
+// over uart. The bulk of each runs 16 bytes at a time with ldm/stm, the
+// unaligned ends in pattern sized stores. Not for registers: access widths
+// vary.
+
+// word is the pattern replicated to 32 bits. width is 1, 2 or 4, and addr and
+// size are multiples of it, so only widths 1 and 2 have unaligned ends.
+static void fill_mem(u32 addr, u32 size, u32 word, u32 width) {
+  const auto store = [&] {
+    switch (width) {
+    case 1:
+      *(u8*)addr = word;
+      break;
+    case 2:
+      *(u16*)addr = word;
+      break;
+    case 4:
+      *(u32*)addr = word;
+      break;
+    }
+    addr += width;
+    size -= width;
+  };
+  while (size && (addr & 3)) {
+    store();
+  }
+  if (size >= 16) {
+    const u32 end = addr + (size & ~15);
+    size &= 15;
+    asm volatile(
+        "mov r4, %2\n"
+        "mov r5, %2\n"
+        "mov r6, %2\n"
+        "mov ip, %2\n"
+        "1: stmia %0!, {r4-r6, ip}\n"
+        "cmp %0, %1\n"
+        "bne 1b\n"
+        : "+r"(addr)
+        : "r"(end), "r"(word)
+        : "r4", "r5", "r6", "ip", "cc", "memory");
+  }
+  for (; size >= 4; size -= 4, addr += 4) {
+    *(u32*)addr = word;
+  }
+  while (size) {
+    store();
+  }
+}
+
+// overlapping regions are fine
+static void copy_mem(u32 dst, u32 src, u32 size) {
+  if (dst > src && dst - src < size) {
+    // dst overlaps the end of src, so copy from the end down. Each ldmdb reads
+    // a whole block before stmdb writes it, so small offsets are fine too.
+    u32 src_end = src + size;
+    u32 dst_end = dst + size;
+    if (!((dst ^ src) & 3)) {
+      for (; size && (src_end & 3); size--) {
+        *(u8*)--dst_end = *(u8*)--src_end;
+      }
+      if (size >= 16) {
+        const u32 start = src_end - (size & ~15);
+        size &= 15;
+        asm volatile(
+            "1: ldmdb %0!, {r4-r6, ip}\n"
+            "stmdb %1!, {r4-r6, ip}\n"
+            "cmp %0, %2\n"
+            "bne 1b\n"
+            : "+r"(src_end), "+r"(dst_end)
+            : "r"(start)
+            : "r4", "r5", "r6", "ip", "cc", "memory");
+      }
+      for (; size >= 4; size -= 4) {
+        src_end -= 4;
+        dst_end -= 4;
+        *(u32*)dst_end = *(u32*)src_end;
+      }
+    }
+    for (; size; size--) {
+      *(u8*)--dst_end = *(u8*)--src_end;
+    }
+    return;
+  }
+  if (!((dst ^ src) & 3)) {
+    for (; size && (src & 3); size--) {
+      *(u8*)dst++ = *(u8*)src++;
+    }
+    if (size >= 16) {
+      const u32 end = src + (size & ~15);
+      size &= 15;
+      asm volatile(
+          "1: ldmia %0!, {r4-r6, ip}\n"
+          "stmia %1!, {r4-r6, ip}\n"
+          "cmp %0, %2\n"
+          "bne 1b\n"
+          : "+r"(src), "+r"(dst)
+          : "r"(end)
+          : "r4", "r5", "r6", "ip", "cc", "memory");
+    }
+    for (; size >= 4; size -= 4, src += 4, dst += 4) {
+      *(u32*)dst = *(u32*)src;
+    }
+  }
+  for (; size; size--) {
+    *(u8*)dst++ = *(u8*)src++;
+  }
+}
+
+// offset of the first differing byte, UINT32_MAX if none
+static u32 compare_mem(u32 addr_a, u32 addr_b, u32 size) {
+  u32 offset = 0;
+  if (!((addr_a ^ addr_b) & 3)) {
+    for (; offset < size && ((addr_a + offset) & 3); offset++) {
+      if (*(u8*)(addr_a + offset) != *(u8*)(addr_b + offset)) {
+        return offset;
+      }
+    }
+    for (; size - offset >= 4; offset += 4) {
+      if (*(u32*)(addr_a + offset) != *(u32*)(addr_b + offset)) {
+        break;
+      }
+    }
+  }
+  for (; offset < size; offset++) {
+    if (*(u8*)(addr_a + offset) != *(u8*)(addr_b + offset)) {
+      return offset;
+    }
+  }
+  return UINT32_MAX;
+}
+
+// crc32 as zlib computes it. The table is built at compile time so it lands in
+// .rodata (nothing would clear .bss).
+static constexpr auto kCrc32Table = [] {
+  std::array<u32, 256> table{};
+  for (u32 i = 0; i < table.size(); i++) {
+    u32 crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+struct Crc32 {
+  void update(const u8* buf, u32 len) {
+    while (len--) {
+      crc_ = kCrc32Table[(crc_ ^ *buf++) & 0xff] ^ (crc_ >> 8);
+    }
+  }
+  template <typename T>
+  void update(const T& val) {
+    update((const u8*)&val, sizeof(T));
+  }
+  u32 value() const { return ~crc_; }
+  static constexpr u32 kDigestLen = 4;
+  void finish(u8* digest) const {
+    const u32 val = value();
+    for (u32 i = 0; i < kDigestLen; i++) {
+      digest[i] = val >> (i * 8);
+    }
+  }
+  u32 crc_{UINT32_MAX};
+};
+
+// for when crc32 is too weak, e.g. verifying uploads
+struct Sha256 {
+  static constexpr u32 kDigestLen = 32;
+  static constexpr u32 kK[64]{
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
+
+  static u32 ror(u32 val, u32 n) { return (val >> n) | (val << (32 - n)); }
+
+  void update(const u8* buf, u32 len) {
+    total_len_ += len;
+    while (len--) {
+      block_[block_len_++] = *buf++;
+      if (block_len_ == sizeof(block_)) {
+        process_block();
+        block_len_ = 0;
+      }
+    }
+  }
+  template <typename T>
+  void update(const T& val) {
+    update((const u8*)&val, sizeof(T));
+  }
+  void finish(u8* digest) {
+    const u64 bit_len = total_len_ * 8;
+    const u8 pad = 0x80;
+    update(&pad, 1);
+    const u8 zero = 0;
+    while (block_len_ != sizeof(block_) - sizeof(bit_len)) {
+      update(&zero, 1);
+    }
+    for (int i = 7; i >= 0; i--) {
+      const u8 b = bit_len >> (i * 8);
+      update(&b, 1);
+    }
+    for (u32 i = 0; i < kDigestLen; i++) {
+      digest[i] = state_[i / 4] >> (24 - (i % 4) * 8);
+    }
+  }
+
+  void process_block() {
+    u32 w[64];
+    for (u32 i = 0; i < 16; i++) {
+      w[i] = (block_[i * 4] << 24) | (block_[i * 4 + 1] << 16) |
+             (block_[i * 4 + 2] << 8) | block_[i * 4 + 3];
+    }
+    for (u32 i = 16; i < 64; i++) {
+      const u32 s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const u32 s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    u32 a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    u32 e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (u32 i = 0; i < 64; i++) {
+      const u32 s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+      const u32 ch = (e & f) ^ (~e & g);
+      const u32 t1 = h + s1 + ch + kK[i] + w[i];
+      const u32 s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+      const u32 maj = (a & b) ^ (a & c) ^ (b & c);
+      const u32 t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+  }
+
+  u32 state_[8]{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  u8 block_[64];
+  u32 block_len_{};
+  u64 total_len_{};
+};
+
 struct DAbortRecord {
   u32 addr{UINT32_MAX};
   u32 status{UINT32_MAX};
@@ -97,6 +363,9 @@ struct Uart {
     RegType reg8;
   };
   using Regs = RegLayout<vu32>;
+  static constexpr u32 kNumRegs = sizeof(Regs) / sizeof(u32);
+  // reg0 (rx), reg1 (tx) and reg3 (status) are what the shell talks through
+  static constexpr u32 kIoRegMask = (1 << 0) | (1 << 1) | (1 << 3);
 
   Uart() {
     // eap_kbl normally inits/uses uart1
@@ -104,13 +373,16 @@ struct Uart {
     // but the baudrate seems to be ~700000
     regs_ = (Regs*)UART0_BASE;
   }
-  u32 fifo_max_len() const {
-    u32 len = 1;
-    // u8 fcr = regs_->fcr;
-    // if (fcr & UART_FCR_FIFOE) {
-    //     len = (fcr & UART_FCR_FIFO64) ? 64 : 16;
-    // }
-    return len;
+  // The fifo control bits of this uart aren't known, so instead of reading
+  // the depth from hw, the host finds the largest burst which doesn't lose
+  // bytes (see CMD_UART_CONFIG) and sets it. Until then it stays at 1.
+  // Bursts are clamped to a 16550 sized fifo: anything deeper is unlikely,
+  // and a burst which overruns the fifo silently loses bytes.
+  static constexpr u32 kFifoMax = 16;
+  u32 fifo_max_len() const { return tx_burst_; }
+  void set_fifo_max_len(u32 len) {
+    tx_burst_ = !len ? 1 : len > kFifoMax ? kFifoMax : len;
+    tx_room_ = 0;
   }
   inline bool rx_ready() const {
     // regs_->lsr & UART_LSR_RX_READY
@@ -137,14 +409,20 @@ struct Uart {
     }
     return true;
   }
-  void write(const u8* buf, u32 len) {
-    const u32 fifo_len = fifo_max_len();
-    const u8* p = buf;
-    while (len) {
+  // tx_ready means the fifo has drained, so a whole burst fits after seeing
+  // it. The room left is carried across calls, so small writes (e.g. one
+  // word per call) are burst too.
+  inline void write_byte(u8 b) {
+    if (!tx_room_) {
       wait_tx_ready();
-      for (u32 i = 0; i < fifo_len && len; i++, len--) {
-        regs_->reg1 = *p++;
-      }
+      tx_room_ = tx_burst_;
+    }
+    regs_->reg1 = b;
+    tx_room_--;
+  }
+  void write(const u8* buf, u32 len) {
+    while (len--) {
+      write_byte(*buf++);
     }
   }
   void write(const char* buf) { write((const u8*)buf, strlen(buf)); }
@@ -159,12 +437,17 @@ struct Uart {
     *data = regs_->reg0;
     return true;
   }
+  // only waits when rx is empty, then drains whatever has arrived
   bool read(u8* data, u32 len, Timeout timeout = (Timeout)1000000) {
     auto p = data;
-    while (p != data + len) {
-      if (!read_byte(p++, timeout)) {
+    const auto end = data + len;
+    while (p != end) {
+      if (!wait_rx_ready(timeout)) {
         return false;
       }
+      do {
+        *p++ = regs_->reg0;
+      } while (p != end && rx_ready());
     }
     return true;
   }
@@ -172,8 +455,99 @@ struct Uart {
   bool read(T* data) {
     return read((u8*)data, sizeof(T));
   }
+  // discards input until the line goes quiet
+  void rx_drain() {
+    u8 b;
+    while (read_byte(&b, (Timeout)1000000)) {
+    }
+  }
 
   Regs* regs_{};
+  u32 tx_burst_{1};
+  // bytes which can be written before checking tx_ready again
+  u32 tx_room_{};
+};
+
+// LZ4 block format compressor: greedy, one hash probe per position, like
+// lz4's fast mode. Output is handed to sink (put(u8), put(buf, len)) as it's
+// produced, so there's no output buffer; literals are passed straight from
+// src. src is read bytewise, since unaligned loads fault with the mmu off.
+struct Lz4 {
+  // table positions are u16
+  static constexpr u32 kBlockMax = 0x10000;
+  static constexpr u32 kHashBits = 10;
+  static constexpr u32 kMinMatch = 4;
+  static constexpr u32 kMaxOffset = 0xffff;
+  // the format wants the last match to start at least this far from the end
+  static constexpr u32 kMatchStartLimit = 12;
+  // and the last bytes to be literals
+  static constexpr u32 kLastLiterals = 5;
+  using Table = u16[1 << kHashBits];
+
+  static u32 read32(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+  }
+  static u32 hash(u32 val) { return (val * 2654435761u) >> (32 - kHashBits); }
+
+  template <typename Sink>
+  static void put_len(Sink& sink, u32 len) {
+    while (len >= 255) {
+      sink.put(255);
+      len -= 255;
+    }
+    sink.put(len);
+  }
+  // match_len 0: the trailing literals
+  template <typename Sink>
+  static void put_sequence(Sink& sink, const u8* literals, u32 literal_len,
+                           u32 offset, u32 match_len) {
+    const u32 ml = match_len ? match_len - kMinMatch : 0;
+    sink.put((u8)(((literal_len < 15 ? literal_len : 15) << 4) |
+                  (ml < 15 ? ml : 15)));
+    if (literal_len >= 15) {
+      put_len(sink, literal_len - 15);
+    }
+    sink.put(literals, literal_len);
+    if (!match_len) {
+      return;
+    }
+    sink.put(offset & 0xff);
+    sink.put(offset >> 8);
+    if (ml >= 15) {
+      put_len(sink, ml - 15);
+    }
+  }
+  template <typename Sink>
+  static void compress(const u8* src, u32 len, Table& table, Sink& sink) {
+    memset(table, 0, sizeof(Table));
+    u32 anchor = 0;
+    if (len > kMatchStartLimit) {
+      const u32 start_limit = len - kMatchStartLimit;
+      const u32 end_limit = len - kLastLiterals;
+      u32 pos = 0;
+      while (pos < start_limit) {
+        const u32 val = read32(&src[pos]);
+        const u32 h = hash(val);
+        const u32 cand = table[h];
+        table[h] = pos;
+        // the table starts out zeroed, so candidates are always verified
+        if (cand >= pos || pos - cand > kMaxOffset ||
+            read32(&src[cand]) != val) {
+          pos++;
+          continue;
+        }
+        u32 match_len = kMinMatch;
+        while (pos + match_len < end_limit &&
+               src[cand + match_len] == src[pos + match_len]) {
+          match_len++;
+        }
+        put_sequence(sink, &src[anchor], pos - anchor, pos - cand, match_len);
+        pos += match_len;
+        anchor = pos;
+      }
+    }
+    put_sequence(sink, &src[anchor], len - anchor, 0, 0);
+  }
 };
 
 struct BcmMbox {
@@ -280,7 +654,9 @@ struct UartServer {
       case 1:
         ok = read_into_mem<u8>(req.addr, req.count);
         break;
-      // case 2: ok = read_into_mem<u16>(req.addr, req.count); break;
+      case 2:
+        ok = read_into_mem<u16>(req.addr, req.count);
+        break;
       case 4:
         ok = read_into_mem<u32>(req.addr, req.count);
         break;
@@ -290,7 +666,9 @@ struct UartServer {
       case 1:
         write_from_mem<u8>(req.addr, req.count);
         break;
-      // case 2: write_from_mem<u16>(req.addr, req.count); break;
+      case 2:
+        write_from_mem<u16>(req.addr, req.count);
+        break;
       case 4:
         write_from_mem<u32>(req.addr, req.count);
         break;
@@ -376,6 +754,438 @@ struct UartServer {
     g_abort_status = {};
     return true;
   }
+  // replies with the previous burst len, which is known to work, before
+  // switching. The new len is clamped to [1, Uart::kFifoMax].
+  bool uart_config() {
+    u32 tx_burst;
+    if (!uart_.read(&tx_burst)) {
+      return false;
+    }
+    uart_.write(uart_.fifo_max_len());
+    uart_.wait_tx_ready();
+    uart_.set_fifo_max_len(tx_burst);
+    return true;
+  }
+  // Switches baudrate by writing divisor to register reg (word index into
+  // Uart::Regs; the layout isn't known, so the host picks it and scales the
+  // divisor from the current value). Acks with the old value at the old rate,
+  // then the host must complete a handshake at the new rate, else the old
+  // divisor is restored, so a bad rate can't strand the shell.
+  // An out of range reg, one of the shell's io regs, or a zero divisor is
+  // refused with UINT32_MAX before anything is written.
+  static constexpr u32 kBaudMagic = 0x5a5aa5a5;
+  // each iteration is an uncached register read, so this is on the order of
+  // a second
+  static constexpr auto kBaudTimeout = (Uart::Timeout)10000000;
+  static constexpr u32 kBaudMaxJunk = 64;
+  // the switch can leave junk in rx, so scan for the magic
+  bool baud_expect(u32 magic) {
+    u32 window = 0;
+    for (u32 i = 0; i < kBaudMaxJunk + sizeof(magic); i++) {
+      u8 b;
+      if (!uart_.read_byte(&b, kBaudTimeout)) {
+        return false;
+      }
+      window = (window >> 8) | ((u32)b << 24);
+      if (window == magic) {
+        return true;
+      }
+    }
+    return false;
+  }
+  bool uart_baud() {
+    struct {
+      u32 reg;
+      u32 divisor;
+    } req{};
+    if (!uart_.read(&req)) {
+      return false;
+    }
+    if (req.reg >= Uart::kNumRegs || ((Uart::kIoRegMask >> req.reg) & 1) ||
+        !req.divisor) {
+      uart_.write(UINT32_MAX);
+      return false;
+    }
+    auto div_reg = &((vu32*)uart_.regs_)[req.reg];
+    const u32 old_divisor = *div_reg;
+    uart_.write(old_divisor);
+    uart_.wait_tx_ready();
+    *div_reg = req.divisor;
+    if (baud_expect(kBaudMagic)) {
+      uart_.write(kBaudMagic + 1);
+      if (baud_expect(kBaudMagic + 2)) {
+        return true;
+      }
+    }
+    uart_.wait_tx_ready();
+    *div_reg = old_divisor;
+    return false;
+  }
+  // Block transfer. Data moves in blocks of block_size bytes (the last may be
+  // short), each framed as {seq, len, data, crc32 of seq..data}, so a lost or
+  // corrupt byte costs a retry of one block rather than the session.
+  // The host drives it: per block it sends XferCtrl (read) or the block
+  // (write, answered by XferReply), and retries on a bad crc or timeout.
+  // Timeouts also resync: a short read is dropped and the other side retries.
+  // Writes go straight to the destination, so a retried block overwrites a
+  // corrupt one.
+  static constexpr u32 kXferEnd = UINT32_MAX;
+  // consecutive idle timeouts after which the host is assumed gone
+  static constexpr u32 kXferMaxIdle = 16;
+  enum XferStatus : u32 {
+    kXferOk,
+    kXferBadCrc,
+    kXferBadHeader,
+    kXferTimeout,
+  };
+  struct XferReq {
+    u32 addr;
+    u32 size;
+    u32 block_size;
+    u8 stride;
+    u8 is_write;
+    // mem_hash only
+    u8 hash_type;
+    u8 pad;
+    // of the above
+    u32 crc;
+  };
+  struct XferHeader {
+    u32 seq;
+    u32 len;
+  };
+  struct XferCtrl {
+    u32 seq;
+    u32 seq_inv;
+  };
+  struct XferReply {
+    u32 seq;
+    u32 status;
+  };
+  static u32 xfer_block_len(const XferReq& req, u32 seq) {
+    const u32 offset = seq * req.block_size;
+    return req.size - offset < req.block_size ? req.size - offset
+                                              : req.block_size;
+  }
+  template <typename T>
+  void xfer_send_block(const XferReq& req, u32 seq) {
+    const XferHeader hdr{seq, xfer_block_len(req, seq)};
+    Crc32 crc;
+    crc.update(hdr);
+    uart_.write(hdr);
+    u32 addr = req.addr + seq * req.block_size;
+    for (u32 i = 0; i < hdr.len; i += sizeof(T)) {
+      const T val = *(T*)addr;
+      addr += sizeof(T);
+      crc.update(val);
+      uart_.write(val);
+    }
+    uart_.write(crc.value());
+  }
+  template <typename T>
+  XferStatus xfer_recv_block(const XferReq& req, const XferHeader& hdr) {
+    Crc32 crc;
+    crc.update(hdr);
+    u32 addr = req.addr + hdr.seq * req.block_size;
+    for (u32 i = 0; i < hdr.len; i += sizeof(T)) {
+      T val;
+      if (!uart_.read(&val)) {
+        return kXferTimeout;
+      }
+      crc.update(val);
+      *(T*)addr = val;
+      addr += sizeof(T);
+    }
+    u32 expected;
+    if (!uart_.read(&expected)) {
+      return kXferTimeout;
+    }
+    return crc.value() == expected ? kXferOk : kXferBadCrc;
+  }
+  // serves reads: sends whichever block the host asks for
+  template <typename SendBlock>
+  bool xfer_serve(const XferReq& req, SendBlock&& send_block) {
+    const u32 num_blocks = (req.size + req.block_size - 1) / req.block_size;
+    for (u32 idle = 0; idle < kXferMaxIdle;) {
+      XferCtrl ctrl;
+      if (!uart_.read(&ctrl)) {
+        idle++;
+        continue;
+      }
+      idle = 0;
+      if (ctrl.seq != ~ctrl.seq_inv) {
+        // the host times out and asks again
+        uart_.rx_drain();
+        continue;
+      }
+      if (ctrl.seq == kXferEnd) {
+        return true;
+      }
+      if (ctrl.seq < num_blocks) {
+        send_block(ctrl.seq);
+      }
+    }
+    return false;
+  }
+  template <typename T>
+  bool xfer_recv(const XferReq& req) {
+    const u32 num_blocks = (req.size + req.block_size - 1) / req.block_size;
+    for (u32 idle = 0; idle < kXferMaxIdle;) {
+      XferHeader hdr;
+      if (!uart_.read(&hdr)) {
+        idle++;
+        continue;
+      }
+      idle = 0;
+      if (hdr.seq == kXferEnd) {
+        return true;
+      }
+      XferReply reply{hdr.seq, kXferBadHeader};
+      if (hdr.seq < num_blocks && hdr.len == xfer_block_len(req, hdr.seq)) {
+        reply.status = xfer_recv_block<T>(req, hdr);
+      } else {
+        // whatever follows isn't a block we can place
+        uart_.rx_drain();
+      }
+      uart_.write(reply);
+    }
+    return false;
+  }
+  // reads and acks a request. valid checks the fields once the crc passed
+  template <typename Valid>
+  bool xfer_begin(XferReq* req, Valid&& valid) {
+    if (!uart_.read(req)) {
+      return false;
+    }
+    Crc32 crc;
+    crc.update((const u8*)req, offsetof(XferReq, crc));
+    u32 status = kXferOk;
+    if (crc.value() != req->crc) {
+      status = kXferBadCrc;
+    } else if (!req->block_size || !valid(*req)) {
+      status = kXferBadHeader;
+    }
+    uart_.write(status);
+    return status == kXferOk;
+  }
+  static bool valid_stride(const XferReq& req) {
+    return (req.stride == 1 || req.stride == 2 || req.stride == 4) &&
+           !(req.block_size % req.stride) && !(req.size % req.stride) &&
+           !(req.addr % req.stride);
+  }
+  bool mem_xfer() {
+    XferReq req;
+    if (!xfer_begin(&req, [](const XferReq& req) {
+          return valid_stride(req);
+        })) {
+      return false;
+    }
+    if (req.is_write) {
+      switch (req.stride) {
+      case 1:
+        return xfer_recv<u8>(req);
+      case 2:
+        return xfer_recv<u16>(req);
+      default:
+        return xfer_recv<u32>(req);
+      }
+    }
+    return xfer_serve(req, [&](u32 seq) {
+      switch (req.stride) {
+      case 1:
+        xfer_send_block<u8>(req, seq);
+        break;
+      case 2:
+        xfer_send_block<u16>(req, seq);
+        break;
+      default:
+        xfer_send_block<u32>(req, seq);
+        break;
+      }
+    });
+  }
+  // Compressed read: like a mem_xfer read, but each block is lz4 compressed
+  // and framed as {seq, len, compressed len, data, crc32 of seq..data}.
+  // Compressing twice (once to size the frame) is much cheaper than sending
+  // the block raw. Memory is read bytewise and more than once, so this isn't
+  // for registers.
+  struct Lz4Header {
+    u32 seq;
+    u32 len;
+    u32 comp_len;
+  };
+  struct Lz4Counter {
+    void put(u8) { len++; }
+    void put(const u8*, u32 n) { len += n; }
+    u32 len{};
+  };
+  struct Lz4UartSink {
+    void put(u8 b) {
+      crc.update(b);
+      uart.write_byte(b);
+    }
+    void put(const u8* buf, u32 n) {
+      crc.update(buf, n);
+      uart.write(buf, n);
+    }
+    Uart& uart;
+    Crc32& crc;
+  };
+  void lz4_send_block(const XferReq& req, u32 seq) {
+    const u32 len = xfer_block_len(req, seq);
+    const auto src = (const u8*)(req.addr + seq * req.block_size);
+    Lz4::Table table;
+    Lz4Counter counter;
+    Lz4::compress(src, len, table, counter);
+    const Lz4Header hdr{seq, len, counter.len};
+    Crc32 crc;
+    crc.update(hdr);
+    uart_.write(hdr);
+    Lz4UartSink sink{uart_, crc};
+    Lz4::compress(src, len, table, sink);
+    uart_.write(crc.value());
+  }
+  bool mem_read_lz4() {
+    XferReq req;
+    if (!xfer_begin(&req, [](const XferReq& req) {
+          return !req.is_write && req.block_size <= Lz4::kBlockMax;
+        })) {
+      return false;
+    }
+    return xfer_serve(req, [&](u32 seq) { lz4_send_block(req, seq); });
+  }
+  // Hashes addr..addr+size in blocks of block_size bytes (the last may be
+  // short; block_size >= size gives one hash over the whole range), so the
+  // host can check an upload, or refetch only the blocks that changed since
+  // its last dump. Replies with the digest of each block as it's done, then
+  // a crc32 over all of them.
+  enum HashType : u8 {
+    kHashCrc32,
+    kHashSha256,
+    kNumHashTypes,
+  };
+  template <typename Hash, typename T>
+  void hash_block(const XferReq& req, u32 seq, Crc32* reply_crc) {
+    const u32 len = xfer_block_len(req, seq);
+    u32 addr = req.addr + seq * req.block_size;
+    Hash hash;
+    for (u32 i = 0; i < len; i += sizeof(T)) {
+      const T val = *(T*)addr;
+      addr += sizeof(T);
+      hash.update(val);
+    }
+    u8 digest[Hash::kDigestLen];
+    hash.finish(digest);
+    reply_crc->update(digest, sizeof(digest));
+    uart_.write(digest, sizeof(digest));
+  }
+  template <typename Hash>
+  void hash_blocks(const XferReq& req) {
+    const u32 num_blocks = (req.size + req.block_size - 1) / req.block_size;
+    Crc32 reply_crc;
+    for (u32 seq = 0; seq < num_blocks; seq++) {
+      switch (req.stride) {
+      case 1:
+        hash_block<Hash, u8>(req, seq, &reply_crc);
+        break;
+      case 2:
+        hash_block<Hash, u16>(req, seq, &reply_crc);
+        break;
+      default:
+        hash_block<Hash, u32>(req, seq, &reply_crc);
+        break;
+      }
+    }
+    uart_.write(reply_crc.value());
+  }
+  bool mem_hash() {
+    XferReq req;
+    if (!xfer_begin(&req, [](const XferReq& req) {
+          return !req.is_write && req.hash_type < kNumHashTypes &&
+                 valid_stride(req);
+        })) {
+      return false;
+    }
+    if (req.hash_type == kHashCrc32) {
+      hash_blocks<Crc32>(req);
+    } else {
+      hash_blocks<Sha256>(req);
+    }
+    return true;
+  }
+  // Fill, copy and compare run on target; each replies once done. Bad args
+  // get UINT32_MAX.
+  bool mem_fill() {
+    struct {
+      u32 addr;
+      u32 size;
+      u32 pattern;
+      u32 width;
+    } req{};
+    if (!uart_.read(&req)) {
+      return false;
+    }
+    if ((req.width != 1 && req.width != 2 && req.width != 4) ||
+        req.addr % req.width || req.size % req.width) {
+      uart_.write(UINT32_MAX);
+      return false;
+    }
+    u32 word = req.pattern;
+    if (req.width == 1) {
+      word = (u8)word * 0x01010101;
+    } else if (req.width == 2) {
+      word = (u16)word * 0x00010001;
+    }
+    fill_mem(req.addr, req.size, word, req.width);
+    uart_.write((u32)0);
+    return true;
+  }
+  bool mem_copy() {
+    struct {
+      u32 dst;
+      u32 src;
+      u32 size;
+    } req{};
+    if (!uart_.read(&req)) {
+      return false;
+    }
+    copy_mem(req.dst, req.src, req.size);
+    uart_.write((u32)0);
+    return true;
+  }
+  // replies with the offset of the first mismatch, UINT32_MAX if equal
+  bool mem_cmp() {
+    struct {
+      u32 addr_a;
+      u32 addr_b;
+      u32 size;
+    } req{};
+    if (!uart_.read(&req)) {
+      return false;
+    }
+    uart_.write(compare_mem(req.addr_a, req.addr_b, req.size));
+    return true;
+  }
+  // Dumps size bytes (as words) from addr, then the cycle count (/64) it
+  // took. The host times it too, to get bytes/sec on the wire.
+  bool dump_bench() {
+    struct {
+      u32 addr;
+      u32 size;
+    } req{};
+    if (!uart_.read(&req)) {
+      return false;
+    }
+    // cycle counter enable, reset, divide by 64
+    arm_wsr(PMCR, arm_rsr(PMCR) | (1 << 0) | (1 << 2) | (1 << 3));
+    arm_wsr(PMCNTENSET, 1u << 31);
+    const u32 start = arm_rsr(PMCCNTR);
+    write_from_mem<u32>(req.addr, req.size / 4);
+    uart_.wait_tx_ready();
+    const u32 cycles = arm_rsr(PMCCNTR) - start;
+    uart_.write(cycles);
+    return true;
+  }
   [[noreturn]] void run() {
     while (1) {
       u32 cmd;
@@ -387,7 +1197,11 @@ struct UartServer {
           &UartServer::ping,          &UartServer::mem_access,
           &UartServer::reg_read,      &UartServer::reg_write,
           &UartServer::int_disable,   &UartServer::int_enable,
-          &UartServer::dabort_status,
+          &UartServer::dabort_status, &UartServer::uart_config,
+          &UartServer::dump_bench,    &UartServer::uart_baud,
+          &UartServer::mem_xfer,      &UartServer::mem_read_lz4,
+          &UartServer::mem_hash,      &UartServer::mem_fill,
+          &UartServer::mem_copy,      &UartServer::mem_cmp,
       };
       if (cmd >= std::size(handlers)) {
         continue;
@@ -2,7 +2,10 @@
 # import subprocess
 # import pyftdi.serialext
 import code
+import os
 import struct
+import threading
+import time
 from tqdm import trange
 from serial import Serial
 from hexdump import hexdump
@@ -78,6 +81,12 @@ class StatusCode:
     kChipConstsInvalid = 0xDEAD0009
     # For rom frames
     kRomFrame = 0xDEAD000A
+    kXmodemNoStart = 0xDEAD000B
+    kXmodemCancelled = 0xDEAD000C
+    kXmodemRetriesExceeded = 0xDEAD000D
+    kMemReadShort = 0xDEAD000E
+    kMemWriteFailed = 0xDEAD000F
+    kXmodemHostTimeout = 0xDEAD0010
 
 
 class ResultType:
@@ -87,16 +96,33 @@ class ResultType:
     kInfo = 3
     kOk = 4
     kNg = 5
+    kRomData = 6
+    kMemData = 7
+    kTimestamp = 8
+    kBlackBox = 9
+    # set in the type byte of frames tagged with a seq
+    kSeqFlag = 0x80
 
 
 class PicoFrame:
     def __init__(self, stream):
         self._type, size = struct.unpack("<BI", stream.read(1 + 4))
+        self._seq = None
+        if self._type & ResultType.kSeqFlag:
+            self._type &= ~ResultType.kSeqFlag
+            self._seq = struct.unpack("<I", stream.read(4))[0]
+            size -= 4
         self._status = None
         if self.is_ok_or_ng():
             self._status = struct.unpack("<I", stream.read(4))[0]
             size -= 4
-        self._response = str(stream.read(size), "ascii")
+        self._response = stream.read(size)
+        if self.is_timestamp():
+            self._response = struct.unpack("<Q", self._response)[0]
+        elif self.is_blackbox():
+            self._response = (struct.unpack("<Q", self._response[:8])[0], self._response[8:])
+        elif not self.is_rom_data() and not self.is_mem_data():
+            self._response = str(self._response, "ascii")
 
     def is_timeout(self):
         return self._type == ResultType.kTimeout
@@ -119,6 +145,20 @@ class PicoFrame:
     def is_ok_or_ng(self):
         return self.is_ok() or self.is_ng()
 
+    def is_rom_data(self):
+        return self._type == ResultType.kRomData
+
+    def is_mem_data(self):
+        return self._type == ResultType.kMemData
+
+    def is_timestamp(self):
+        # response is the pico time_us_64 at which the next line started
+        return self._type == ResultType.kTimestamp
+
+    def is_blackbox(self):
+        # response is (pico time_us_64 of the first byte, data)
+        return self._type == ResultType.kBlackBox
+
     def is_ok_status(self, status):
         return self.is_ok() and self._status == status
 
@@ -140,6 +180,10 @@ class PicoFrame:
     def response(self) -> str:
         return self._response
 
+    @property
+    def seq(self):
+        return self._seq
+
     def __repr__(self) -> str:
         if self.is_ok_or_ng():
             r = "OK" if self.is_ok() else "NG"
@@ -150,8 +194,30 @@ class PicoFrame:
             return f"$$ {self.response}"
         elif self.is_unknown():
             return self.response
+        elif self.is_rom_data():
+            return f"rom {self.response.hex()}"
+        elif self.is_mem_data():
+            return f"mem {self.response.hex()}"
+        elif self.is_timestamp():
+            return f"@{self.response}us"
+        elif self.is_blackbox():
+            return f"bb @{self.response[0]}us {self.response[1]}"
         return "timeout"
 
+class PicoError(Exception):
+    # a pico cmd didn't succeed. frame is its final frame, None on timeout
+    def __init__(self, cmd: str, frame: PicoFrame | None):
+        super().__init__(f"{cmd}: {frame if frame is not None else 'timeout'}")
+        self.frame = frame
+
+    @staticmethod
+    def check(cmd: str, frames: list[PicoFrame]) -> PicoFrame:
+        # returns the final frame if it's a success
+        frame = frames[-1] if frames else None
+        if frame is None or not frame.is_success():
+            raise PicoError(cmd, frame)
+        return frame
+
 class Ucmd:
     def __init__(self):
         self.port = Serial("COM5", timeout=0.5)
@@ -186,16 +252,38 @@ class Ucmd:
         self.wait_frame(ResultType.kUnknown, response=cmdline)
         return self.wait_frame((ResultType.kOk, ResultType.kNg), **kwargs)
 
+    def cmd_send_recv_pipelined(self, cmdlines: list[str], timeout=None) -> list[PicoFrame]:
+        # all cmds go out in one write. the pico sends each to emc once the
+        # previous one is echoed, and tags their frames with the index here.
+        # returns the OK/NG/timeout frame of each cmd (None if never seen)
+        self.port.write(bytes("".join(f"@{seq:x} {cmdline}\n" for seq, cmdline in enumerate(cmdlines)), "ascii"))
+        results = [None] * len(cmdlines)
+        remaining = len(cmdlines)
+        accept_types = (ResultType.kOk, ResultType.kNg, ResultType.kTimeout)
+        while remaining:
+            frames = self.wait_frame(accept_types, timeout=timeout)
+            if len(frames) == 0 or frames[-1].rtype not in accept_types:
+                break
+            seq = frames[-1].seq
+            if seq is None or seq >= len(results) or results[seq] is not None:
+                continue
+            results[seq] = frames[-1]
+            remaining -= 1
+        return results
+
 
     def _rom_pull_bytes(self):
-        frames = self.wait_frame(ResultType.kOk)
+        frames = self.wait_frame((ResultType.kOk, ResultType.kRomData))
         if len(frames) == 0:
             return 0
         num_read = 0
         for frame in frames:
-            if not frame.is_ok_status(StatusCode.kRomFrame):
+            if frame.is_rom_data():
+                data = frame.response
+            elif frame.is_ok_status(StatusCode.kRomFrame):
+                data = bytes.fromhex(frame.response)
+            else:
                 continue
-            data = bytes.fromhex(frame.response)
             num_read += len(data)
             self.rom_buf += data
         return num_read
@@ -224,10 +312,24 @@ class Ucmd:
             if self._rom_pull_bytes() == 0:
                 return None
 
+    # binary rom line: marker, then data with \n and escape bytes escaped
+    ROM_LINE_MARKER = 0x02
+    ROM_LINE_ESCAPE = 0x1b
+    ROM_LINE_XOR = 0x20
+
+    def rom_write(self, data: bytes):
+        line = bytearray([self.ROM_LINE_MARKER])
+        for b in data:
+            if b in (ord('\n'), self.ROM_LINE_ESCAPE):
+                line += bytes([self.ROM_LINE_ESCAPE, b ^ self.ROM_LINE_XOR])
+            else:
+                line.append(b)
+        line.append(ord('\n'))
+        self.port.write(line)
+
     # info, down, jump
     def rom_cmd(self, cmd: str):
-        cmd = bytes(cmd + '\n', 'ascii').hex()
-        self.port.write(bytes(cmd + '\n', 'ascii'))
+        self.rom_write(bytes(cmd + '\n', 'ascii'))
         self.rom_read_until(b'\n> ')
 
     def rom_info(self):
@@ -242,7 +344,28 @@ class Ucmd:
         ready = self.rom_read_until(b'\n')
         assert ready == b'\x15ready\n'
 
-    def rom_send(self, buf: bytes):
+    # sends an image for a pico xmodem cmd. returns the final frame
+    def _pico_image_send(self, cmdline: str, buf: bytes):
+        self.port.write(bytes(cmdline + '\n', 'ascii'))
+        self.wait_frame(ResultType.kUnknown, response=cmdline)
+        started = self.wait_frame((ResultType.kComment, ResultType.kNg))
+        if len(started) == 0 or not started[-1].is_comment():
+            return started[-1] if len(started) else None
+        self.port.write(buf)
+        frames = self.wait_frame((ResultType.kOk, ResultType.kNg), timeout=15)
+        for frame in frames:
+            if frame.is_comment():
+                print(frame.response)
+        return frames[-1] if len(frames) else None
+
+    # xmodem runs on the pico, host just streams the image
+    def rom_send(self, buf: bytes, use_1k=False):
+        self.rom_read_discard()
+        cmdline = f'picoemcxm {len(buf):x}' + (' 1k' if use_1k else '')
+        frame = self._pico_image_send(cmdline, buf)
+        return frame is not None and frame.is_success()
+
+    def rom_send_host(self, buf: bytes):
         from xmodem import XMODEM
         import io
         def getc(size: int, timeout=1):
@@ -250,11 +373,7 @@ class Ucmd:
             return self.rom_read(size)
         def putc(data: bytes, timeout=1):
             #print('putc', data.hex())
-            for i in range(0, len(data), 66):
-                line = data[i:i+66].hex() + '\n'
-                self.port.write(bytes(line, 'ascii'))
-                import time
-                time.sleep(.01)
+            self.rom_write(data)
         xm = XMODEM(getc, putc)
         self.rom_read_discard()
         def debug(total_packets, success_count, error_count):
@@ -461,12 +580,12 @@ class Ucmd:
         return b"".join(data)
 
     def fcddr_read(self, addr, size):
-        addr_aligned = align_down(addr, 4)
-        offset = addr - addr_aligned
-        # because of emc bug, need multiple of 0x10 to get 'OK' on newline
-        size_aligned = align_up(offset + size, 0x10)
-        data = self.parse_hexdump(self.cmd_send_recv(f"fcddrr {addr_aligned:x} {size_aligned:x}"))
-        return data[offset : offset + size]
+        # the pico splits this into fcddrr cmds (with the 0x10 size workaround)
+        # and sends back binary frames
+        cmdline = f"picoread {addr:x} {size:x}"
+        frames = self.cmd_send_recv(cmdline, timeout=5)
+        PicoError.check(cmdline, frames)
+        return b"".join(f.response for f in frames if f.is_mem_data())
 
     def fcddr_read32(self, addr):
         return int.from_bytes(self.fcddr_read(addr, 4), "little")
@@ -476,21 +595,14 @@ class Ucmd:
         self.cmd_send_recv(f"fcddrw {addr:x} {val:x}")
 
     def fcddr_write(self, addr, data):
-        offset = addr & 3
-        if offset != 0:
-            addr -= offset
-            val = self.fcddr_read(addr, offset)
-            self.fcddr_write32(addr, int.from_bytes(val + data[: 4 - offset], "little"))
-            addr += 4
-            data = data[4 - offset :]
-        len_aligned = align_down(len(data), 4)
-        for i in range(0, len_aligned, 4):
-            self.fcddr_write32(addr + i, int.from_bytes(data[i : i + 4], "little"))
-        rem = len(data) - len_aligned
-        if rem != 0:
-            addr += len_aligned
-            val = self.fcddr_read(addr + rem, 4 - rem)
-            self.fcddr_write32(addr, int.from_bytes(data[len_aligned:] + val, "little"))
+        # the pico does the read-modify-write of partial words and sends the
+        # fcddrw cmds back to back. on failure, the response is a hex bitmap of
+        # the failed words
+        cmdline = f"picowrite {addr:x} {len(data):x}"
+        self.port.write(bytes(cmdline + "\n", "ascii") + data)
+        self.wait_frame(ResultType.kUnknown, response=cmdline)
+        frames = self.wait_frame((ResultType.kOk, ResultType.kNg), timeout=5)
+        return PicoError.check(cmdline, frames)
 
     FCDDR_REAL_SIZE = 0x20000000
 
@@ -698,8 +810,13 @@ class Ucmd:
         seq += [
             # 0x201b,
         ]
-        for s in seq:
-            self.runseq(s)
+        cmdlines = [f"runseq {s:04X}" for s in seq]
+        results = self.cmd_send_recv_pipelined(cmdlines)
+        # the rest were already queued to emc, but the first failure is what
+        # matters. None: never answered
+        for cmdline, frame in zip(cmdlines, results):
+            if frame is None or not frame.is_success():
+                raise PicoError(cmdline, frame)
 
     def unlock_efc(self, use_uart_shell=False):
         # patch emc's titania_ddr_density to make alias
@@ -811,11 +928,43 @@ class Ucmd:
         return self.cmd_send_recv(f'picoemcrom {cmd}')
 
     def pico_emc_rom_enter(self):
-        return self._pico_emc_rom('enter')
+        return self._pico_emc_rom('enter bin')
 
     def pico_emc_rom_exit(self):
         return self._pico_emc_rom('exit')
 
+    def pico_stats(self) -> dict:
+        frame = PicoError.check("picostats", self.cmd_send_recv("picostats"))
+        return {k: int(v) for k, v in (kv.split("=") for kv in frame.response.split())}
+
+    def pico_latency(self, arg=""):
+        frames = self.cmd_send_recv(f"picolat {arg}".strip())
+        for f in frames:
+            if f.is_comment():
+                print(f.response)
+        return frames[-1]
+
+    def pico_timestamps(self, channel: str, enable: bool):
+        # channel is emc or efc
+        return self.cmd_send_recv(f"picots {channel} {int(enable)}")
+
+    def pico_backpressure(self, channel: str, watermark: int):
+        # channel is emc or efc. 0 turns it off
+        return self.cmd_send_recv(f"picobp {channel} {watermark:x}")
+
+    def pico_blackbox(self, channel: str) -> list[tuple[int, bytes]]:
+        # channel is emc or efc. oldest first: (pico time_us_64, line/chunk)
+        frames = self.cmd_send_recv(f"picobb {channel}", timeout=5)
+        return [f.response for f in frames if f.is_blackbox()]
+
+    def pico_blackbox_clear(self, channel: str):
+        return self.cmd_send_recv(f"picobb {channel} clear")
+
+    # titania bootrom (uart1 bootmode) down + xmodem + run, done by the pico.
+    # OK status is what the rom printed (0 if nothing: image is running)
+    def pico_efc_boot(self, buf: bytes):
+        return self._pico_image_send(f'picoefcboot {len(buf):x}', buf)
+
     def pico_chip_const(self, version):
         return self.cmd_send_recv(f'picochipconst {version}')
 
@@ -843,6 +992,58 @@ class Ucmd:
                 return
             self.wait_frame(ResultType.kInfo, timeout=5)
 
+def efc_read_chunk(port):
+    # titania output after "picots efc 1": u16 len, u64 pico time_us_64 of the
+    # first byte, data
+    size, time_us = struct.unpack("<HQ", port.read(2 + 8))
+    return time_us, port.read(size)
+
+
+def efc_loopback_stress(port_name="COM19", baudrate=2000000, size=0x200000,
+                        stall_every=0x20000, stall_s=0.1):
+    # Needs the pico's titania uart tx jumpered to its rx (nothing else
+    # attached). Streams size bytes around the loop at full line rate while
+    # the reader stops reading for stall_s every stall_every bytes, then checks
+    # that every byte came back and the pico dropped nothing.
+    # The host os buffers some usb data itself; efc.rx_high_water shows how
+    # much of each stall the pico had to absorb.
+    emc = Ucmd()
+    emc.pico_timestamps("efc", False)
+    before = emc.pico_stats()
+    # the line coding sets the uart baudrate
+    port = Serial(port_name, baudrate=baudrate, timeout=1)
+    port.reset_input_buffer()
+    data = os.urandom(size)
+
+    def writer():
+        for pos in range(0, size, 0x1000):
+            port.write(data[pos : pos + 0x1000])
+
+    start = time.monotonic()
+    thread = threading.Thread(target=writer)
+    thread.start()
+    received = bytearray()
+    next_stall = stall_every
+    while len(received) < size:
+        if len(received) >= next_stall:
+            time.sleep(stall_s)
+            next_stall += stall_every
+        chunk = port.read(min(size - len(received), 0x1000))
+        if not chunk:
+            break
+        received += chunk
+    elapsed = time.monotonic() - start
+    thread.join()
+    port.close()
+    after = emc.pico_stats()
+    delta = {k: after[k] - before[k] for k in ("efc.rx_dropped", "efc.overrun_errors")}
+    print(f"{len(received):#x}/{size:#x} bytes in {elapsed:.2f}s ({len(received) / elapsed / 1024:.1f} KiB/s)")
+    print(f"rx_size {after['efc.rx_size']:#x} rx_high_water {after['efc.rx_high_water']:#x} {delta}")
+    ok = bytes(received) == data and not any(delta.values())
+    print("PASS" if ok else "FAIL")
+    return ok
+
+
 def parse_hexdump(path: Path):
     data = []
     with path.open("r") as f:
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string>
+
+#include "types.h"
+
+// Keeps the most recent output of a uart whether or not a host is listening,
+// so logs of e.g. a boot or crash can be fetched after the fact.
+// Entries are {u16 len, u64 time_us, data} packed back to back in a byte ring.
+// The oldest entries are dropped to make room for new ones.
+// Only touched by the protocol code (never from irq), so no atomics.
+template <size_t Size>
+class BlackBox {
+ public:
+  // longer records are split
+  static constexpr size_t kEntryMax = Size / 4;
+
+  // Walks entries oldest first. Stays usable while entries are recorded: if
+  // the entry it points at is dropped, it skips to the oldest one left.
+  struct Cursor {
+    size_t pos;
+    u32 index;
+  };
+
+  void record(u64 time_us, const void* buf, size_t len) {
+    auto data = static_cast<const u8*>(buf);
+    while (len) {
+      const size_t entry_len = std::min(len, kEntryMax);
+      push(time_us, data, entry_len);
+      data += entry_len;
+      len -= entry_len;
+    }
+  }
+
+  Cursor begin() const { return {head_, first_index_}; }
+  // index one past the newest entry
+  u32 end_index() const { return first_index_ + num_entries_; }
+
+  // Copies out the entry at cursor and advances it. Returns false if there
+  // are no more entries.
+  bool read(Cursor* cursor, u64* time_us, std::string* data) const {
+    if (static_cast<s32>(first_index_ - cursor->index) > 0) {
+      *cursor = begin();
+    }
+    if (cursor->index == end_index()) {
+      return false;
+    }
+    u16 len;
+    copy_out(cursor->pos, &len, sizeof(len));
+    copy_out(add(cursor->pos, sizeof(len)), time_us, sizeof(*time_us));
+    data->resize(len);
+    copy_out(add(cursor->pos, kHeaderLen), data->data(), len);
+    cursor->pos = add(cursor->pos, kHeaderLen + len);
+    cursor->index++;
+    return true;
+  }
+
+  void clear() {
+    first_index_ += num_entries_;
+    num_entries_ = 0;
+    head_ = add(head_, used_);
+    used_ = 0;
+  }
+
+  // entries dropped to make room
+  u32 num_overwritten() const { return num_overwritten_; }
+
+ private:
+  static constexpr size_t kHeaderLen = sizeof(u16) + sizeof(u64);
+  static_assert(kEntryMax + kHeaderLen <= Size);
+  // entry len is stored as u16
+  static_assert(kEntryMax <= 0xffff);
+
+  static size_t add(size_t pos, size_t addend) { return (pos + addend) % Size; }
+
+  void copy_in(size_t pos, const void* buf, size_t len) {
+    const auto src = static_cast<const u8*>(buf);
+    const size_t first = std::min(len, Size - pos);
+    std::memcpy(&ring_[pos], src, first);
+    std::memcpy(&ring_[0], src + first, len - first);
+  }
+  void copy_out(size_t pos, void* buf, size_t len) const {
+    const auto dst = static_cast<u8*>(buf);
+    const size_t first = std::min(len, Size - pos);
+    std::memcpy(dst, &ring_[pos], first);
+    std::memcpy(dst + first, &ring_[0], len - first);
+  }
+
+  void drop_oldest() {
+    u16 len;
+    copy_out(head_, &len, sizeof(len));
+    head_ = add(head_, kHeaderLen + len);
+    used_ -= kHeaderLen + len;
+    first_index_++;
+    num_entries_--;
+    num_overwritten_++;
+  }
+
+  void push(u64 time_us, const u8* data, size_t len) {
+    const size_t entry_len = kHeaderLen + len;
+    while (Size - used_ < entry_len) {
+      drop_oldest();
+    }
+    const size_t pos = add(head_, used_);
+    const u16 len16 = len;
+    copy_in(pos, &len16, sizeof(len16));
+    copy_in(add(pos, sizeof(len16)), &time_us, sizeof(time_us));
+    copy_in(add(pos, kHeaderLen), data, len);
+    used_ += entry_len;
+    num_entries_++;
+  }
+
+  std::array<u8, Size> ring_{};
+  // oldest entry
+  size_t head_{};
+  size_t used_{};
+  u32 first_index_{};
+  u32 num_entries_{};
+  u32 num_overwritten_{};
+};
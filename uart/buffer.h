@@ -0,0 +1,420 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <string>
+#include <string_view>
+#ifdef ENABLE_DEBUG_STDIO
+#include <cstdio>
+#endif
+
+#include <hardware/timer.h>
+
+#include "string_utils.h"
+#include "types.h"
+#include "uart.h"
+
+// Validates emc output lines of the form "<payload>:<csum hex8>[\r]*\n" as
+// they are received, one byte at a time, so the verdict is ready when the
+// newline arrives. The csum is the byte sum of everything before the last
+// colon. Must not alloc; runs in irq.
+struct EmcLineChecker {
+  static constexpr u16 kInvalid = UINT16_MAX;
+
+  void feed(u8 b) {
+    len_++;
+    if (b == ':') {
+      // only the last colon counts
+      payload_len_ = len_ - 1;
+      payload_sum_ = sum_;
+      tail_ = {};
+      have_colon_ = true;
+    } else if (have_colon_) {
+      u8 nibble;
+      if (b == '\r') {
+        tail_.cr = true;
+      } else if (tail_.cr || tail_.len >= 2 || !hex2nibble(b, &nibble)) {
+        tail_.bad = true;
+      } else {
+        tail_.csum = (tail_.csum << 4) | nibble;
+        tail_.len++;
+      }
+    }
+    sum_ += b;
+  }
+  // a byte of the current line was lost
+  void corrupt() { corrupt_ = true; }
+  // Called on newline. Returns length of payload, or kInvalid.
+  u16 finish() {
+    const bool valid = !corrupt_ && have_colon_ && !tail_.bad &&
+                       tail_.len == 2 && tail_.csum == payload_sum_;
+    const u16 payload_len = valid ? payload_len_ : kInvalid;
+    *this = {};
+    return payload_len;
+  }
+
+  u16 len_{};
+  u16 payload_len_{};
+  u8 sum_{};
+  u8 payload_sum_{};
+  bool have_colon_{};
+  bool corrupt_{};
+  struct {
+    u8 csum;
+    u8 len;
+    bool cr;
+    bool bad;
+  } tail_{};
+};
+
+// Single producer (uart rx irq, or the consumer itself when rx is done via
+// dma) / single consumer ring. Each index and counter has exactly one writer,
+// so only atomic loads/stores are needed; cortex-m0+ has no exclusive access
+// instructions and RMW atomics would need irq masking.
+// If NumLineSlots is nonzero, the producer also records where each newline
+// is and whether the line passed EmcLineChecker, so read_line can copy a
+// validated line out without scanning or parsing it again.
+// DmaRing aligns the ring for use by Uart::rx_dma_init.
+template <size_t BufferSize, size_t NumLineSlots = 0, bool DmaRing = false>
+struct Buffer {
+  static constexpr bool kTrackLines = NumLineSlots != 0;
+  // longest line peek_line returns; longer ones are counted as bad lines
+  static constexpr size_t kLineMax = std::min<size_t>(BufferSize, 0x1000);
+  static_assert(std::popcount(BufferSize) == 1);
+  static_assert(!kTrackLines || std::popcount(NumLineSlots) == 1);
+  // line_ends are u16
+  static_assert(!kTrackLines || BufferSize <= 0x10000);
+
+  constexpr size_t len_mask() const { return BufferSize - 1; }
+  constexpr size_t add(size_t val, size_t addend) const {
+    return (val + addend) & len_mask();
+  }
+  constexpr size_t distance(size_t from, size_t to) const {
+    return (to - from) & len_mask();
+  }
+  size_t read_available() {
+    sync();
+    return distance(rpos.load(std::memory_order_relaxed),
+                    wpos.load(std::memory_order_acquire));
+  }
+  bool empty() { return !read_available(); }
+  size_t num_newlines() const {
+    return lines_pushed.load(std::memory_order_acquire) -
+           lines_popped.load(std::memory_order_relaxed);
+  }
+  // Returns a view of the next line, with checksum removed. The view points
+  // into the ring (or into scratch_ if the line wraps around the end), and is
+  // valid until pop_line().
+  bool peek_line(std::string_view* line) {
+    static_assert(kTrackLines);
+    sync();
+    // line slots are published before wpos, so load wpos first
+    const auto w = wpos.load(std::memory_order_acquire);
+    const auto popped = lines_popped.load(std::memory_order_relaxed);
+    if (lines_pushed.load(std::memory_order_acquire) == popped) {
+      return false;
+    }
+    const auto r = rpos.load(std::memory_order_relaxed);
+    const auto [sol, eol, payload_len, start_us] =
+        line_ends[popped % NumLineSlots];
+    if (distance(r, eol) >= distance(r, w)) {
+      // the newline itself isn't published yet
+      return false;
+    }
+    // NOTE emc can emit invalid lines if its ucmd print func is reentered
+    // (print called simultaneously via irq or task switch or something). Not
+    // much can be done except trying not to hit this condition by waiting for
+    // outputs before sending new cmd.
+    // If the start of the line was already consumed (clear() or read_buf),
+    // the checksum doesn't cover what's left.
+    if (payload_len == EmcLineChecker::kInvalid || r != sol ||
+        payload_len > kLineMax) {
+      num_bad_lines++;
+#ifdef ENABLE_DEBUG_STDIO
+      const auto len = distance(r, eol);
+      const auto first = std::min(len, BufferSize - r);
+      printf("DROP:%.*s%.*s\n", static_cast<int>(first), &buffer[r],
+             static_cast<int>(len - first), &buffer[0]);
+#endif
+      pop_line();
+      return false;
+    }
+    const auto first = std::min<size_t>(payload_len, BufferSize - r);
+    if (first == payload_len) {
+      *line = {reinterpret_cast<const char*>(&buffer[r]), payload_len};
+    } else {
+      std::memcpy(&scratch_[0], &buffer[r], first);
+      std::memcpy(&scratch_[first], &buffer[0], payload_len - first);
+      *line = {&scratch_[0], payload_len};
+    }
+    return true;
+  }
+  // When the first byte of the line last returned by peek_line was seen.
+  u64 line_start_us() const {
+    static_assert(kTrackLines);
+    return line_ends[lines_popped.load(std::memory_order_relaxed) %
+                     NumLineSlots]
+        .start_us;
+  }
+  // When the oldest unread byte was seen. Only exact if the previous read
+  // emptied the buffer; otherwise it's a lower bound.
+  // Only valid while read_available() is nonzero: the producer only updates it
+  // when pushing into an empty buffer.
+  u64 oldest_us() const { return oldest_us_; }
+  // Releases the line last returned by peek_line back to the producer.
+  void pop_line() {
+    const auto popped = lines_popped.load(std::memory_order_relaxed);
+    const auto eol = line_ends[popped % NumLineSlots].eol;
+    lines_popped.store(popped + 1, std::memory_order_relaxed);
+    rpos.store(add(eol, 1), std::memory_order_release);
+  }
+  bool read_line(std::string* line) {
+    std::string_view view;
+    if (!peek_line(&view)) {
+      return false;
+    }
+    line->assign(view);
+    pop_line();
+    return true;
+  }
+  bool read_line_timeout(std::string* line, u32 timeout_us) {
+    const u32 start = time_us_32();
+    do {
+      if (read_line(line)) {
+        return true;
+      }
+    } while (time_us_32() - start < timeout_us);
+    return false;
+  }
+  size_t read_buf(u8* buf, size_t len) {
+    len = std::min(len, read_available());
+    const auto r = rpos.load(std::memory_order_relaxed);
+    const auto first = std::min(len, BufferSize - r);
+    std::memcpy(buf, &buffer[r], first);
+    std::memcpy(buf + first, &buffer[0], len - first);
+    pop(r, add(r, len));
+    return len;
+  }
+  // Producer side bulk write, for plain byte queues.
+  size_t write_buf(const u8* buf, size_t len) {
+    static_assert(!kTrackLines);
+    len = std::min(len, write_available());
+    const auto w = wpos.load(std::memory_order_relaxed);
+    const auto first = std::min(len, BufferSize - w);
+    std::memcpy(&buffer[w], buf, first);
+    std::memcpy(&buffer[0], buf + first, len - first);
+    wpos.store(add(w, len), std::memory_order_release);
+    return len;
+  }
+  size_t write_available() const {
+    // one slot is kept free to tell full from empty
+    return BufferSize - 1 -
+           distance(rpos.load(std::memory_order_acquire),
+                    wpos.load(std::memory_order_relaxed));
+  }
+  // called from irq. cannot do allocs, etc.
+  void push(u8 b) {
+    const auto w = wpos.load(std::memory_order_relaxed);
+    const auto r = rpos.load(std::memory_order_acquire);
+    const auto wpos_next = add(w, 1);
+    // a full ring shows as BufferSize
+    count_received(1, distance(r, w) + 1);
+    if (r == w) {
+      oldest_us_ = time_us_64();
+    }
+    if constexpr (kTrackLines) {
+      if (w == line_start_) {
+        line_start_us_ = time_us_64();
+      }
+    }
+    if (wpos_next == r) {
+      // overflow. basically fatal, should show error led or smth then fix bug?
+      count_dropped(1);
+      if constexpr (kTrackLines) {
+        line_checker_.corrupt();
+      }
+      return;
+    }
+    if constexpr (kTrackLines) {
+      if (b == '\n') {
+        if (!push_line_end(w)) {
+          // out of line slots. dropping the newline merges two lines; make
+          // sure the result fails checksum.
+          count_dropped(1);
+          line_checker_.corrupt();
+          return;
+        }
+      } else {
+        line_checker_.feed(b);
+      }
+    }
+    buffer[w] = b;
+    wpos.store(wpos_next, std::memory_order_release);
+  }
+  void setup_irq(Uart* uart) { uart_ = uart; }
+  void uart_rx_handler() {
+    uart_->try_read([&](u8 b) { push(b); });
+  }
+  // Must be called after uart init. After this, rx irq is no longer used and
+  // the bookkeeping push() would do is done by the consumer in sync().
+  bool setup_dma() {
+    static_assert(DmaRing);
+    dma_count_ = 0;
+    return uart_->rx_dma_init(buffer.data(), BufferSize);
+  }
+  // Publish bytes which rx dma has written since last call.
+  void sync() {
+    if (!uart_ || !uart_->rx_dma_enabled()) {
+      return;
+    }
+    const u32 count = uart_->rx_dma_count();
+    const u32 produced = count - dma_count_;
+    if (!produced) {
+      return;
+    }
+    dma_count_ = count;
+    // make sure buffer contents are read after the dma counter
+    std::atomic_signal_fence(std::memory_order_acquire);
+    const auto w = wpos.load(std::memory_order_relaxed);
+    const auto r = rpos.load(std::memory_order_relaxed);
+    const auto used = distance(r, w);
+    if (produced >= BufferSize - used) {
+      // dma has lapped the reader and overwritten unread data. There's no
+      // telling which lines survived, so discard everything.
+      count_dropped(used + produced);
+      count_received(produced, BufferSize);
+      const auto w_next = add(w, produced);
+      wpos.store(w_next, std::memory_order_release);
+      if constexpr (kTrackLines) {
+        lines_popped.store(lines_pushed.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+        line_checker_.corrupt();
+        line_start_ = w_next;
+      }
+      rpos.store(w_next, std::memory_order_release);
+      return;
+    }
+    // arrival within the batch can't be told apart. it's as old as the last
+    // sync at most
+    const u64 now = time_us_64();
+    if (!used) {
+      oldest_us_ = now;
+    }
+    if constexpr (kTrackLines) {
+      for (size_t i = 0; i < produced; i++) {
+        const auto pos = add(w, i);
+        const auto b = buffer[pos];
+        if (pos == line_start_) {
+          line_start_us_ = now;
+        }
+        if (b != '\n') {
+          line_checker_.feed(b);
+        } else if (!push_line_end(pos)) {
+          // can't drop the byte here. the unindexed newline winds up in the
+          // middle of the next line, which must then fail checksum.
+          count_dropped(1);
+          line_checker_.corrupt();
+        }
+      }
+    }
+    wpos.store(add(w, produced), std::memory_order_release);
+    count_received(produced, used + produced);
+  }
+  void clear() {
+    sync();
+    pop(rpos.load(std::memory_order_relaxed),
+        wpos.load(std::memory_order_acquire));
+  }
+
+  Uart* uart_{};
+  // bytes lost to overflow. in dma mode, includes unread bytes discarded
+  std::atomic<size_t> num_dropped{};
+  // bytes which arrived from the uart, dropped or not
+  std::atomic<size_t> num_received{};
+  // most bytes ever waiting to be read
+  std::atomic<size_t> high_water{};
+  // lines which failed checksum (consumer side)
+  size_t num_bad_lines{};
+  // consumer side. with backpressure on, the consumer stops whatever makes
+  // the other end talk while more than this many bytes are waiting. 0 is off
+  size_t watermark{};
+  // times backpressure kicked in
+  size_t num_backpressure{};
+  bool above_watermark() {
+    const bool above = watermark && read_available() > watermark;
+    num_backpressure += above && !backpressure_;
+    backpressure_ = above;
+    return above;
+  }
+  static constexpr size_t capacity() { return BufferSize - 1; }
+
+ private:
+  // producer side
+  void count_dropped(size_t count) {
+    num_dropped.store(num_dropped.load(std::memory_order_relaxed) + count,
+                      std::memory_order_relaxed);
+  }
+  void count_received(size_t count, size_t used) {
+    num_received.store(num_received.load(std::memory_order_relaxed) + count,
+                       std::memory_order_relaxed);
+    if (used > high_water.load(std::memory_order_relaxed)) {
+      high_water.store(used, std::memory_order_relaxed);
+    }
+  }
+  bool push_line_end(size_t pos) {
+    const auto pushed = lines_pushed.load(std::memory_order_relaxed);
+    if (pushed - lines_popped.load(std::memory_order_acquire) == NumLineSlots) {
+      return false;
+    }
+    line_ends[pushed % NumLineSlots] = {static_cast<u16>(line_start_),
+                                        static_cast<u16>(pos),
+                                        line_checker_.finish(), line_start_us_};
+    line_start_ = add(pos, 1);
+    lines_pushed.store(pushed + 1, std::memory_order_release);
+    return true;
+  }
+  // consumer side. releases [r, rpos_next) back to the producer.
+  void pop(size_t r, size_t rpos_next) {
+    if constexpr (kTrackLines) {
+      const auto consumed = distance(r, rpos_next);
+      const auto pushed = lines_pushed.load(std::memory_order_acquire);
+      auto popped = lines_popped.load(std::memory_order_relaxed);
+      while (popped != pushed &&
+             distance(r, line_ends[popped % NumLineSlots].eol) < consumed) {
+        popped++;
+      }
+      lines_popped.store(popped, std::memory_order_relaxed);
+    }
+    rpos.store(rpos_next, std::memory_order_release);
+  }
+
+  std::atomic<size_t> wpos{};
+  std::atomic<size_t> rpos{};
+  // counts of line_ends slots ever filled/freed
+  std::atomic<size_t> lines_pushed{};
+  std::atomic<size_t> lines_popped{};
+  struct LineEnd {
+    u16 sol;
+    u16 eol;
+    // EmcLineChecker::kInvalid if the line failed checksum
+    u16 payload_len;
+    u64 start_us;
+  };
+  std::array<LineEnd, NumLineSlots> line_ends{};
+  // producer side
+  EmcLineChecker line_checker_;
+  size_t line_start_{};
+  u64 line_start_us_{};
+  u64 oldest_us_{};
+  // consumer side
+  bool backpressure_{};
+  // holds a line which wraps
+  std::array<char, kTrackLines ? kLineMax : 0> scratch_{};
+  u32 dma_count_{};
+  // The dma ring has to be aligned to its size, which pads the whole struct
+  // out to a multiple of it, so only pay for that when dma is used.
+  alignas(DmaRing ? BufferSize : 1) std::array<u8, BufferSize> buffer{};
+};
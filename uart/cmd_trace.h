@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <deque>
+#include <format>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include <hardware/timer.h>
+
+#include "types.h"
+
+// Latency tracing for ucmds sent to emc. Each cmd is timestamped as it passes
+// through: received from host, on the wire (tx ring and fifo drained), echo
+// matched, first response line, and status (OK/NG).
+// Phase durations go into per cmd name histograms, and the last kTraceLen cmds
+// are kept for post mortem (e.g. after a timeout).
+// emc handles cmds in order, so in-flight cmds are matched against its output
+// oldest first.
+class CmdTracer {
+ public:
+  enum Phase {
+    // host -> on the wire
+    kPhaseTx,
+    // on the wire -> echo
+    kPhaseEcho,
+    // echo -> first response line
+    kPhaseFirst,
+    // last of the above -> status
+    kPhaseStatus,
+    // host -> status
+    kPhaseTotal,
+    kNumPhases,
+  };
+  // bucket n counts durations < 2^(n + kBucketShift) us, the last one
+  // everything longer
+  static constexpr size_t kNumBuckets = 16;
+  static constexpr int kBucketShift = 7;
+  using Histogram = std::array<u32, kNumBuckets>;
+
+  struct Trace {
+    std::string cmd;
+    u32 host_us{};
+    // relative to host_us. 0 if not reached
+    u32 tx_us{};
+    u32 echo_us{};
+    u32 first_us{};
+    u32 status_us{};
+    bool timed_out{};
+  };
+
+  void sent(std::string_view cmdline, u32 host_us) {
+    if (inflight_.size() == kMaxInflight) {
+      finish(true);
+    }
+    inflight_.push_back({.cmd = std::string(cmdline), .host_us = host_us});
+  }
+
+  // catches the tx ring draining, and gives up on cmds emc never finished
+  void poll(bool tx_busy) {
+    if (inflight_.empty()) {
+      return;
+    }
+    const u32 now = time_us_32();
+    if (!tx_busy) {
+      for (auto& trace : inflight_) {
+        if (!trace.tx_us) {
+          trace.tx_us = since(trace, now);
+        }
+      }
+    }
+    while (!inflight_.empty() &&
+           now - inflight_.front().host_us >= kTimeoutUs) {
+      finish(true);
+    }
+  }
+
+  // a line from emc
+  void line(std::string_view line, bool is_status) {
+    if (inflight_.empty()) {
+      return;
+    }
+    const u32 now = time_us_32();
+    const auto unechoed = std::ranges::find_if(
+        inflight_, [](const auto& trace) { return !trace.echo_us; });
+    if (unechoed != inflight_.end() && line == unechoed->cmd) {
+      unechoed->echo_us = since(*unechoed, now);
+      if (!unechoed->tx_us) {
+        unechoed->tx_us = unechoed->echo_us;
+      }
+      return;
+    }
+    auto& oldest = inflight_.front();
+    if (!oldest.echo_us) {
+      return;
+    }
+    if (is_status) {
+      oldest.status_us = since(oldest, now);
+      finish(false);
+    } else if (!oldest.first_us) {
+      oldest.first_us = since(oldest, now);
+    }
+  }
+
+  // "<name> <phase> <bucket counts..>"
+  template <typename Output>
+  void dump_histograms(Output&& output) const {
+    static constexpr const char* phase_names[kNumPhases]{"tx", "echo", "first",
+                                                         "status", "total"};
+    for (const auto& [name, histograms] : histograms_) {
+      for (size_t phase = 0; phase < kNumPhases; phase++) {
+        std::string line = std::format("{} {}", name, phase_names[phase]);
+        for (const auto count : histograms[phase]) {
+          line += std::format(" {}", count);
+        }
+        output(line);
+      }
+    }
+  }
+
+  // oldest first, then cmds still in flight
+  template <typename Output>
+  void dump_trace(Output&& output) const {
+    for (size_t i = 0; i < kTraceLen; i++) {
+      const auto& trace = traces_[(trace_pos_ + i) % kTraceLen];
+      if (!trace.cmd.empty()) {
+        output(format(trace, trace.timed_out ? "timeout" : ""));
+      }
+    }
+    for (const auto& trace : inflight_) {
+      output(format(trace, "inflight"));
+    }
+  }
+
+  void clear() {
+    histograms_.clear();
+    traces_ = {};
+    trace_pos_ = 0;
+  }
+
+ private:
+  static constexpr size_t kMaxInflight = 16;
+  static constexpr size_t kMaxNames = 16;
+  static constexpr size_t kTraceLen = 32;
+  static constexpr u32 kTimeoutUs = 5'000'000;
+
+  static u32 since(const Trace& trace, u32 now) {
+    return std::max<u32>(now - trace.host_us, 1);
+  }
+
+  static size_t bucket(u32 us) {
+    const int width = std::bit_width(us);
+    return std::min<size_t>(std::max(width - kBucketShift, 0), kNumBuckets - 1);
+  }
+
+  static std::string format(const Trace& trace, std::string_view note) {
+    return std::format("{} @{} tx={} echo={} first={} status={} {}", trace.cmd,
+                       trace.host_us, trace.tx_us, trace.echo_us,
+                       trace.first_us, trace.status_us, note);
+  }
+
+  // retires the oldest in-flight cmd
+  void finish(bool timed_out) {
+    auto trace = std::move(inflight_.front());
+    inflight_.pop_front();
+    trace.timed_out = timed_out;
+    if (!timed_out) {
+      record(trace);
+    }
+    traces_[trace_pos_] = std::move(trace);
+    trace_pos_ = (trace_pos_ + 1) % kTraceLen;
+  }
+
+  void record(const Trace& trace) {
+    auto name = trace.cmd.substr(0, trace.cmd.find(' '));
+    // "other" takes the last slot, so there are never more than kMaxNames
+    if (!histograms_.contains(name) && histograms_.size() >= kMaxNames - 1) {
+      name = "other";
+    }
+    auto& histograms = histograms_[name];
+    const u32 before_status = trace.first_us ? trace.first_us : trace.echo_us;
+    histograms[kPhaseTx][bucket(trace.tx_us)]++;
+    histograms[kPhaseEcho][bucket(trace.echo_us - trace.tx_us)]++;
+    if (trace.first_us) {
+      histograms[kPhaseFirst][bucket(trace.first_us - trace.echo_us)]++;
+    }
+    histograms[kPhaseStatus][bucket(trace.status_us - before_status)]++;
+    histograms[kPhaseTotal][bucket(trace.status_us)]++;
+  }
+
+  std::deque<Trace> inflight_;
+  std::map<std::string, std::array<Histogram, kNumPhases>> histograms_;
+  std::array<Trace, kTraceLen> traces_{};
+  size_t trace_pos_{};
+};
@@ -14,4 +14,4 @@
 #define CFG_TUD_CDC             2
 #endif
 #define CFG_TUD_CDC_RX_BUFSIZE  256
-#define CFG_TUD_CDC_TX_BUFSIZE  256
+#define CFG_TUD_CDC_TX_BUFSIZE  1024
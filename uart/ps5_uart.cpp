@@ -2,6 +2,7 @@
 #include <array>
 #include <atomic>
 #include <cstring>
+#include <deque>
 #include <format>
 #include <list>
 #include <map>
@@ -10,18 +11,31 @@
 #include <vector>
 
 #include <hardware/gpio.h>
-#include <hardware/sync.h>
+#include <hardware/clocks.h>
 #include <hardware/timer.h>
 #include <pico/bootrom.h>
 #ifdef ENABLE_DEBUG_STDIO
 #include <pico/stdio_usb.h>
 #endif
+#ifdef ENABLE_MULTICORE
+#include <pico/multicore.h>
+#endif
 #include <tusb.h>
 
+#include "blackbox.h"
+#include "buffer.h"
 #include "button.h"
+#include "cmd_trace.h"
 #include "string_utils.h"
+#include "task.h"
 #include "types.h"
 #include "uart.h"
+#include "xmodem.h"
+
+#if defined(ENABLE_MULTICORE) && defined(ENABLE_DEBUG_STDIO)
+// stdio_usb would be driving tinyusb from core1
+#error ENABLE_MULTICORE and ENABLE_DEBUG_STDIO are mutually exclusive
+#endif
 
 u8 checksum(std::string_view buf) {
   u8 csum = 0;
@@ -31,27 +45,6 @@ u8 checksum(std::string_view buf) {
   return csum;
 }
 
-bool validate_line(std::string* line) {
-  if (line->empty()) {
-    return false;
-  }
-  strip_trailing_crlf(line);
-  auto last_colon = line->find_last_of(':');
-  if (last_colon == line->npos || last_colon + 3 != line->size()) {
-    return false;
-  }
-  std::vector<u8> csum;
-  auto view = std::string_view(*line);
-  if (!hex2buf(view.substr(last_colon + 1), &csum)) {
-    return false;
-  }
-  if (csum[0] != checksum(view.substr(0, last_colon))) {
-    return false;
-  }
-  line->resize(last_colon);
-  return true;
-}
-
 enum StatusCode : u32 {
   kSuccess = 0,
   kRxInputTooLong = 0xE0000002,
@@ -72,6 +65,12 @@ enum StatusCode : u32 {
   kChipConstsInvalid,
   // For rom frames
   kRomFrame,
+  kXmodemNoStart,
+  kXmodemCancelled,
+  kXmodemRetriesExceeded,
+  kMemReadShort,
+  kMemWriteFailed,
+  kXmodemHostTimeout,
 };
 
 struct FwConstants {
@@ -107,122 +106,185 @@ static std::map<std::string, FwConstants> fw_constants_map{
        0xf6, 0xbd, 0x11, 0xc0, 0xf2, 0x12, 0x01, 0x88, 0x47, 0x00, 0xbd}}},
 };
 
-struct ScopedIrqDisable {
-  inline ScopedIrqDisable() { status = save_and_disable_interrupts(); }
-  inline ~ScopedIrqDisable() { restore_interrupts(status); }
-  u32 status{};
+// rx ring sizes, see EMC_RX_BUFFER_SIZE/EFC_RX_BUFFER_SIZE in CMakeLists.txt
+#ifndef EMC_RX_BUFFER_SIZE
+#define EMC_RX_BUFFER_SIZE 16384
+#endif
+#ifndef EFC_RX_BUFFER_SIZE
+#define EFC_RX_BUFFER_SIZE 32768
+#endif
+// dma ring wrap is at most 1 << 15
+static constexpr size_t kDmaRingMax = 0x8000;
+#ifdef ENABLE_EMC_RX_DMA
+static_assert(EMC_RX_BUFFER_SIZE <= kDmaRingMax);
+static constexpr bool kEmcRxDma = true;
+#else
+static constexpr bool kEmcRxDma = false;
+#endif
+#ifdef ENABLE_EFC_RX_DMA
+static_assert(EFC_RX_BUFFER_SIZE <= kDmaRingMax);
+static constexpr bool kEfcRxDma = true;
+#else
+static constexpr bool kEfcRxDma = false;
+#endif
+// emc lines are at least 4 chars (":XX\n"), but usually much longer
+using EmcRxBuffer =
+    Buffer<EMC_RX_BUFFER_SIZE, EMC_RX_BUFFER_SIZE / 32, kEmcRxDma>;
+using EfcRxBuffer = Buffer<EFC_RX_BUFFER_SIZE, 0, kEfcRxDma>;
+
+// per uart, see BLACKBOX_SIZE in CMakeLists.txt
+#ifndef BLACKBOX_SIZE
+#define BLACKBOX_SIZE 16384
+#endif
+using UartBlackBox = BlackBox<BLACKBOX_SIZE>;
+
+// per cdc interface, counted by CdcPort (protocol side)
+struct UsbStats {
+  // host -> pico
+  u32 rx_bytes;
+  // pico -> host
+  u32 tx_bytes;
+  // writes which had to wait for the host to make room
+  u32 write_stalls;
+  // writes abandoned because the host went away
+  u32 write_aborts;
 };
-
-template <size_t BufferSize>
-struct Buffer {
-  constexpr size_t len_mask() const {
-    static_assert(std::popcount(BufferSize) == 1);
-    return BufferSize - 1;
-  }
-  constexpr size_t add(size_t val, size_t addend) const {
-    return (val + addend) & len_mask();
-  }
-  constexpr size_t read_available() const {
-    if (wpos >= rpos) {
-      return wpos - rpos;
-    }
-    return BufferSize - rpos + wpos;
-  }
-  constexpr bool empty() const { return rpos == wpos; }
-  bool read_line(std::string* line) {
-    // aggressively inlining compilers could wind up making this an empty delay
-    // loop if num_newlines==0 on entry. This barrier prevents that.
-    std::atomic_signal_fence(std::memory_order_acquire);
-    // purposefully done before masking irqs as a speed hack
-    if (!num_newlines || empty()) {
-      return false;
-    }
-    bool got_line = false;
-    {
-      ScopedIrqDisable irq_disable;
-      const auto avail = read_available();
-      for (size_t i = 0; i < avail; i++) {
-        const auto cpos = add(rpos, i);
-        const auto c = buffer[cpos];
-        if (c == '\n') {
-          num_newlines--;
-          rpos = add(cpos, 1);
-          got_line = true;
-          break;
-        }
-        line->push_back(c);
+static std::array<UsbStats, CFG_TUD_CDC> s_usb_stats;
+
+// The host side of a cdc interface, as seen by the uart/protocol code.
+// Normally this just forwards to tinyusb. With ENABLE_MULTICORE the protocol
+// code runs on core1 while core0 owns tinyusb, so each interface gets a pair of
+// spsc queues which core0 moves to/from tinyusb in CdcQueues::pump.
+#ifdef ENABLE_MULTICORE
+struct CdcQueues {
+  // core0 only
+  void pump(u8 itf) {
+    // before moving data, see Efc::follow_line_coding
+    connected.store(tud_cdc_n_connected(itf), std::memory_order_relaxed);
+    cdc_line_coding_t coding{};
+    tud_cdc_n_get_line_coding(itf, &coding);
+    bit_rate.store(coding.bit_rate, std::memory_order_relaxed);
+    std::array<u8, 64> buf;
+    // usb -> core1
+    while (tud_cdc_n_available(itf)) {
+      const auto len = std::min(buf.size(), rx.write_available());
+      if (!len) {
+        break;
       }
+      rx.write_buf(buf.data(), tud_cdc_n_read(itf, buf.data(), len));
     }
-    if (got_line) {
-      // validate and remove checksum
-      // NOTE emc can emit invalid lines if its ucmd print func is reentered
-      // (print called simultaneously via irq or task switch or something). Not
-      // much can be done except trying not to hit this condition by waiting for
-      // outputs before sending new cmd.
-      if (validate_line(line)) {
-        return true;
+    // core1 -> usb. only take what tinyusb can hold
+    bool wrote = false;
+    while (true) {
+      const auto len = std::min<size_t>(buf.size(),
+                                        tud_cdc_n_write_available(itf));
+      const auto num_read = tx.read_buf(buf.data(), len);
+      if (!num_read) {
+        break;
       }
-#ifdef ENABLE_DEBUG_STDIO
-      // TODO bubble error up to host?
-      printf("DROP:%s\n", line->c_str());
-#endif
+      tud_cdc_n_write(itf, buf.data(), num_read);
+      wrote = true;
+    }
+    if (wrote) {
+      tud_cdc_n_write_flush(itf);
     }
-    // might have modified line, clear it
-    line->clear();
-    return false;
   }
-  bool read_line_timeout(std::string* line, u32 timeout_us) {
-    const u32 start = time_us_32();
-    do {
-      if (read_line(line)) {
-        return true;
-      }
-    } while (time_us_32() - start < timeout_us);
-    return false;
+
+  // host -> core1
+  Buffer<1024> rx;
+  // core1 -> host
+  Buffer<2048> tx;
+  std::atomic<bool> connected;
+  std::atomic<u32> bit_rate;
+};
+static std::array<CdcQueues, CFG_TUD_CDC> s_cdc_queues;
+
+struct CdcPort {
+  // most that write_available() ever reports
+  static constexpr u32 kWriteCapacity = decltype(CdcQueues::tx)::capacity();
+  static u32 available(u8 itf) { return s_cdc_queues[itf].rx.read_available(); }
+  static u32 read(u8 itf, void* buf, u32 len) {
+    const u32 num_read =
+        s_cdc_queues[itf].rx.read_buf(static_cast<u8*>(buf), len);
+    s_usb_stats[itf].rx_bytes += num_read;
+    return num_read;
   }
-  size_t read_buf(u8* buf, size_t len) {
-    ScopedIrqDisable irq_disable;
-    const auto avail = read_available();
-    len = std::min(len, avail);
-    for (size_t i = 0; i < len; i++) {
-      const auto c = buffer[rpos];
-      if (c == '\n') {
-        num_newlines--;
-      }
-      *buf++ = c;
-      rpos = add(rpos, 1);
-    }
-    return len;
-  }
-  // called from irq. cannot do allocs, etc.
-  void push(u8 b) {
-    const auto wpos_next = add(wpos, 1);
-    if (wpos_next == rpos) {
-      // overflow. basically fatal, should show error led or smth then fix bug?
-      // drop the write here, as otherwise we'd have to fixup num_newlines
-    } else {
-      buffer[wpos] = b;
-      wpos = wpos_next;
-    }
-    if (b == '\n') {
-      num_newlines++;
-    }
+  static u32 write_available(u8 itf) {
+    return s_cdc_queues[itf].tx.write_available();
+  }
+  static u32 write(u8 itf, const void* buf, u32 len) {
+    const u32 num_written =
+        s_cdc_queues[itf].tx.write_buf(static_cast<const u8*>(buf), len);
+    s_usb_stats[itf].tx_bytes += num_written;
+    return num_written;
+  }
+  // core0 flushes whatever it moves
+  static void write_flush(u8 itf) {}
+  static bool connected(u8 itf) {
+    return s_cdc_queues[itf].connected.load(std::memory_order_relaxed);
+  }
+  static u32 bit_rate(u8 itf) {
+    return s_cdc_queues[itf].bit_rate.load(std::memory_order_relaxed);
+  }
+};
+#else
+struct CdcPort {
+  // most that write_available() ever reports
+  static constexpr u32 kWriteCapacity = CFG_TUD_CDC_TX_BUFSIZE;
+  static u32 available(u8 itf) { return tud_cdc_n_available(itf); }
+  static u32 read(u8 itf, void* buf, u32 len) {
+    const u32 num_read = tud_cdc_n_read(itf, buf, len);
+    s_usb_stats[itf].rx_bytes += num_read;
+    return num_read;
+  }
+  static u32 write_available(u8 itf) { return tud_cdc_n_write_available(itf); }
+  static u32 write(u8 itf, const void* buf, u32 len) {
+    const u32 num_written = tud_cdc_n_write(itf, buf, len);
+    s_usb_stats[itf].tx_bytes += num_written;
+    return num_written;
+  }
+  static void write_flush(u8 itf) { tud_cdc_n_write_flush(itf); }
+  static bool connected(u8 itf) { return tud_cdc_n_connected(itf); }
+  static u32 bit_rate(u8 itf) {
+    cdc_line_coding_t coding{};
+    tud_cdc_n_get_line_coding(itf, &coding);
+    return coding.bit_rate;
+  }
+};
+#endif
+
+// Writes all of buf, waiting for the host to make room. Returns false if the
+// host went away first.
+static bool cdc_write_all(u8 itf, const void* buf, size_t len) {
+  auto data = static_cast<const u8*>(buf);
+  u32 num_written = 0;
+  bool stalled = false;
+  while (CdcPort::connected(itf) && num_written < len) {
+    const u32 n = CdcPort::write(itf, &data[num_written], len - num_written);
+    stalled |= !n;
+    num_written += n;
   }
-  void setup_irq(Uart* uart) { uart_ = uart; }
-  void uart_rx_handler() {
-    uart_->try_read([&](u8 b) { push(b); });
+  auto& stats = s_usb_stats[itf];
+  stats.write_stalls += stalled;
+  if (num_written < len) {
+    stats.write_aborts++;
+    return false;
   }
-  void clear() {
-    ScopedIrqDisable irq_disable;
-    wpos = rpos = num_newlines = {};
+  return true;
+}
+
+// iteration time of the loop running the protocol code
+struct LoopStats {
+  void add(u32 us) {
+    num_iterations++;
+    total_us += us;
+    max_us = std::max(max_us, us);
   }
-  Uart* uart_{};
-  size_t wpos{};
-  size_t rpos{};
-  size_t num_newlines{};
-  std::array<u8, BufferSize> buffer{};
+  u32 num_iterations{};
+  u64 total_us{};
+  u32 max_us{};
 };
-using Buffer1k = Buffer<1024>;
+static LoopStats s_loop_stats;
 
 struct ActiveLowGpio {
   void init(uint gpio) {
@@ -247,63 +309,390 @@ struct EmcResetGpio : ActiveLowGpio {
   bool is_reset() const { return sample() == false; }
 };
 
-struct UcmdClientEmc {
+struct Efc {
   bool init() {
+    uart_rx_.setup_irq(&uart_);
+    if (!uart_.init(1, 460800 /*700000*/, rx_handler)) {
+      return false;
+    }
+#ifdef ENABLE_EFC_RX_DMA
+    if (!uart_rx_.setup_dma()) {
+      return false;
+    }
+#endif
+    return true;
+  }
+  static void rx_handler() { uart_rx_.uart_rx_handler(); }
+  // The uart follows the host's line coding, so a rate switch (e.g. uart_shell
+  // CMD_UART_BAUD) is just a matter of the host reopening at the new rate.
+  // Host data sent before the switch must still go out at the old rate, and
+  // anything after at the new one, so the switch waits for tx to drain and
+  // holds back host data meanwhile. Returns false while waiting.
+  bool follow_line_coding(u8 itf) {
+    const u32 bit_rate = CdcPort::bit_rate(itf);
+    if (!bit_rate || bit_rate == uart_.baudrate()) {
+      return true;
+    }
+    if (uart_.tx_busy()) {
+      return false;
+    }
+    uart_.set_baudrate(bit_rate);
+    return true;
+  }
+  // usb -> uart passthrough. Only takes what fits in the tx ring; the rest
+  // stays in the usb fifo, which stops the host once full.
+  void host_rx(u8 itf) {
+    if (boot_active()) {
+      // left in the fifo while the bootrom transfer owns the uart
+      return;
+    }
+    if (uart_rx_.above_watermark()) {
+      // titania can't be paused, but what it's told to do can
+      follow_line_coding(itf);
+      return;
+    }
+    std::array<u8, 64> buf;
+    while (true) {
+      const auto host_avail = CdcPort::available(itf);
+      // checked after available(), so data the host sent after changing line
+      // coding is seen with the new rate (CdcQueues::pump publishes it first)
+      if (!follow_line_coding(itf)) {
+        break;
+      }
+      const auto len =
+          std::min({host_avail, static_cast<u32>(uart_.write_available()),
+                    static_cast<u32>(buf.size())});
+      if (!len) {
+        break;
+      }
+      const auto num_read = CdcPort::read(itf, buf.data(), len);
+      uart_.write(buf.data(), num_read);
+    }
+  }
+  void cdc_process(u8 itf, u32 max_time_us = 1'000) {
+    if (boot_active()) {
+      // the bootrom transfer owns the uart
+      return;
+    }
+    // rx callback only fires for new usb data, so pick up what didn't fit
+    // (this also follows line coding changes)
+    host_rx(itf);
+
+    const u32 start = time_us_32();
+    do {
+      const auto read_avail = static_cast<u32>(uart_rx_.read_available());
+      const bool connected = CdcPort::connected(itf);
+      const u32 header_len = timestamps_ ? sizeof(ChunkHeader) : 0;
+      // with nobody listening, output only goes to the black box
+      const u32 write_avail = connected ? CdcPort::write_available(itf)
+                                        : UartBlackBox::kEntryMax + header_len;
+      if (write_avail <= header_len) {
+        break;
+      }
+      const auto xfer_len =
+          std::min({read_avail, write_avail - header_len, kChunkMax});
+      if (!xfer_len) {
+        break;
+      }
+      // must be read before the data
+      const ChunkHeader header{.len = static_cast<u16>(xfer_len),
+                               .time_us = uart_rx_.oldest_us()};
+      const auto buf = chunk_buf_.data();
+      uart_rx_.read_buf(buf, xfer_len);
+      blackbox_.record(header.time_us, buf, xfer_len);
+      if (!connected) {
+        continue;
+      }
+      if ((timestamps_ && !cdc_write_all(itf, &header, sizeof(header))) ||
+          !cdc_write_all(itf, buf, xfer_len)) {
+        return;
+      }
+      CdcPort::write_flush(itf);
+    } while (time_us_32() - start < max_time_us);
+  }
+
+  // With timestamps_, each chunk of titania output is preceded by this.
+  // time_us is when the pico saw the first byte of the chunk (time_us_64).
+  struct [[gnu::packed]] ChunkHeader {
+    u16 len;
+    u64 time_us;
+  };
+  // a usb write can't take more than the cdc tx fifo holds anyway
+  static constexpr u32 kChunkMax = CFG_TUD_CDC_TX_BUFSIZE;
+  std::array<u8, kChunkMax> chunk_buf_;
+  bool timestamps_{};
+  UartBlackBox blackbox_;
+
+  // Titania bootrom on uart1: "down", xmodem-1k/crc, then "run". The image is
+  // pulled from the data source as blocks are sent.
+  // The rom reports errors as a "0x<status>" line; during the transfer it's
+  // followed by NAK/C, after which the rom only wants EOT.
+  struct BootResult {
+    XmodemSender::Status xmodem;
+    std::optional<u32> rom_status;
+  };
+
+  bool boot_active() const { return boot_state_ != kBootIdle; }
+  const XmodemSender& boot_xmodem() const { return xmodem_; }
+
+  void boot_start(u32 size) {
+    boot_prev_baudrate_ = uart_.baudrate();
+    uart_.set_baudrate(460800);
+    uart_rx_.clear();
+    rom_line_.clear();
+    rom_status_ = {};
+    write_str("down\n");
+    xmodem_.start(size, true, false);
+    boot_state_ = kBootXmodem;
+  }
+
+  template <typename DataSource>
+  std::optional<BootResult> boot_poll(DataSource& data) {
+    if (boot_state_ == kBootXmodem) {
+      BootromIo<DataSource> io{*this, data};
+      const auto status = xmodem_.poll(io);
+      if (status == XmodemSender::kBusy) {
+        if (rom_status_.has_value()) {
+          xmodem_.cancel();
+        }
+        return {};
+      }
+      if (status != XmodemSender::kDone || rom_status_.has_value()) {
+        // after an error the rom only wants EOT
+        if (status != XmodemSender::kDone &&
+            (rom_status_.has_value() || status == XmodemSender::kHostTimeout)) {
+          const u8 eot = 0x04;
+          uart_.write(&eot, 1);
+        }
+        boot_end(false);
+        return BootResult{status, rom_status_};
+      }
+      uart_rx_.clear();
+      rom_line_.clear();
+      write_str("run\n");
+      boot_deadline_ = make_timeout_time_ms(kRunTimeoutMs);
+      boot_state_ = kBootRun;
+      return {};
+    }
+    if (boot_state_ == kBootRun) {
+      u8 b;
+      while (!rom_status_.has_value() && uart_rx_.read_buf(&b, 1)) {
+        rom_feed(b);
+      }
+      // no status before the timeout means the image is running
+      if (rom_status_.has_value() ||
+          absolute_time_diff_us(get_absolute_time(), boot_deadline_) <= 0) {
+        boot_end(!rom_status_.has_value());
+        return BootResult{XmodemSender::kDone, rom_status_};
+      }
+    }
+    return {};
+  }
+  // a failed boot leaves the uart as it was. a running image keeps the rom's
+  // rate until the host changes line coding
+  void boot_end(bool running) {
+    if (!running) {
+      // CAN/EOT still go out at the rom's rate
+      while (uart_.tx_busy()) {
+        tight_loop_contents();
+      }
+      uart_.set_baudrate(boot_prev_baudrate_);
+    }
+    boot_state_ = kBootIdle;
+  }
+
+  Uart uart_;
+  static EfcRxBuffer uart_rx_;
+
+  enum BootState {
+    kBootIdle,
+    kBootXmodem,
+    kBootRun,
+  };
+  static constexpr u32 kRunTimeoutMs = 5'000;
+
+  template <typename DataSource>
+  struct BootromIo {
+    size_t read_data(u8* buf, size_t len) { return data.read_data(buf, len); }
+    bool read_byte(u8* b) {
+      // once the rom has complained, hide the NAK so the block isn't resent
+      if (efc.rom_status_.has_value() || !efc.uart_rx_.read_buf(b, 1)) {
+        return false;
+      }
+      efc.rom_feed(*b);
+      return true;
+    }
+    void write(const u8* buf, size_t len) { efc.uart_.write(buf, len); }
+    Efc& efc;
+    DataSource& data;
+  };
+
+  void write_str(std::string_view str) {
+    uart_.write(reinterpret_cast<const u8*>(str.data()), str.size());
+  }
+
+  // collects rom output lines, looking for "0x<status>"
+  void rom_feed(u8 b) {
+    if (b == '\n') {
+      const auto pos = rom_line_.find("0x");
+      if (pos != std::string::npos) {
+        rom_status_ = int_from_hex<u32>(rom_line_, pos + 2);
+      }
+      rom_line_.clear();
+    } else if (b >= ' ' && rom_line_.size() < kRomLineMax) {
+      rom_line_.push_back(b);
+    }
+  }
+  static constexpr size_t kRomLineMax = 64;
+
+  BootState boot_state_{kBootIdle};
+  XmodemSender xmodem_;
+  std::string rom_line_;
+  std::optional<u32> rom_status_;
+  absolute_time_t boot_deadline_{};
+  uint boot_prev_baudrate_{};
+};
+EfcRxBuffer Efc::uart_rx_;
+
+struct UcmdClientEmc {
+  bool init(Efc* efc) {
+    efc_ = efc;
     uart_rx_.setup_irq(&uart_);
     if (!uart_.init(0, 115200, rx_handler)) {
       return false;
     }
+#ifdef ENABLE_EMC_RX_DMA
+    if (!uart_rx_.setup_dma()) {
+      return false;
+    }
+#endif
     rom_gpio_.init(2);
     reset_.init(3);
     return true;
   }
 
+  // queued: returns once buf is in the tx ring
+  void write_str(std::string_view buf) {
+    uart_.write(reinterpret_cast<const u8*>(buf.data()), buf.size());
+  }
+  // bypasses the tx ring, for when timing matters
   void write_str_blocking(std::string_view buf, bool wait_tx = true) {
     uart_.write_blocking(reinterpret_cast<const u8*>(buf.data()), buf.size(),
                          wait_tx);
   }
-
-  bool read_line(std::string* line, u32 timeout_us) {
-    return uart_rx_.read_line_timeout(line, timeout_us);
+  // queued, yielding whenever the tx ring is full
+  Task<> write_str_yielding(std::string_view buf) {
+    while (true) {
+      buf.remove_prefix(uart_.try_write(
+          reinterpret_cast<const u8*>(buf.data()), buf.size()));
+      if (buf.empty()) {
+        co_return;
+      }
+      co_await runner_.yield();
+    }
   }
 
-  static void rx_handler() { uart_rx_.uart_rx_handler(); }
+  Task<bool> read_line(std::string* line, u32 timeout_us) {
+    const u32 start = time_us_32();
+    do {
+      tracer_.poll(uart_.tx_busy());
+      std::string_view view;
+      if (uart_rx_.peek_line(&view)) {
+        record_line(view);
+        line->assign(view);
+        uart_rx_.pop_line();
+        tracer_.line(*line, ResultView::from_str(*line).is_ok_or_ng());
+        co_return true;
+      }
+      co_await runner_.yield();
+    } while (time_us_32() - start < timeout_us);
+    co_return false;
+  }
 
-  void cdc_write(u8 itf, const std::vector<u8>& buf) {
-    const auto len = buf.size();
-    u32 num_written = 0;
-    while (tud_cdc_n_connected(itf) && num_written < len) {
-      num_written += tud_cdc_n_write(itf, &buf[num_written], len - num_written);
-    }
-    if (!tud_cdc_n_connected(itf)) {
-      return;
-    }
-    tud_cdc_n_write_flush(itf);
+  // keeps the line last peeked from uart_rx_ in the black box
+  void record_line(std::string_view line) {
+    blackbox_.record(uart_rx_.line_start_us(), line.data(), line.size());
   }
 
+  static void rx_handler() { uart_rx_.uart_rx_handler(); }
+
   // write as many lines from uart rx buffer to usb as possible within
   // max_time_us
   void cdc_process(u8 itf, u32 max_time_us = 1'000) {
+    if (image_active()) {
+      xmodem_process(itf, max_time_us);
+      return;
+    }
+    if (cmd_task_.valid()) {
+      // the task consumes emc output itself
+      cmd_task_process(itf);
+      return;
+    }
     const u32 start = time_us_32();
     do {
       if (!in_rom_) {
-        std::string line;
-        if (!uart_rx_.read_line(&line)) {
+        seq_pump(itf);
+        tracer_.poll(uart_.tx_busy());
+        // the line is framed straight out of the rx ring
+        std::string_view line;
+        if (!uart_rx_.peek_line(&line)) {
+          break;
+        }
+        if (!cdc_frames_fit(itf, line.size() + (timestamps_ ? sizeof(u64) : 0),
+                            timestamps_ ? 2 : 1)) {
           break;
         }
-        dbg_println(std::format("host<{}", line));
-        cdc_write(itf, Result::from_str(line).to_usb_response());
+        dbg_println("host<{}", line);
+        record_line(line);
+        const u32 frame_start = time_us_32();
+        auto view = ResultView::from_str(line);
+        tracer_.line(line, view.is_ok_or_ng());
+        seq_tag(&view);
+        if (timestamps_) {
+          const u64 time_us = uart_rx_.line_start_us();
+          cdc_write(itf, ResultView{.type_ = kTimestamp,
+                                    .response_ = std::string_view(
+                                        reinterpret_cast<const char*>(&time_us),
+                                        sizeof(time_us))});
+        }
+        cdc_write(itf, view);
+        frame_stats_.add(frame_start, time_us_32());
+        uart_rx_.pop_line();
+        if (frame_stats_.num_frames % 1024 == 0) {
+          dbg_println("frames {} avg {} max {} cycles", frame_stats_.num_frames,
+                      frame_stats_.avg_cycles(), frame_stats_.max_cycles());
+        }
+      } else if (rom_binary_) {
+        std::array<u8, 0x100> buf;
+        const auto num_read =
+            uart_rx_.read_buf(buf.data(), cdc_frame_room(itf, buf.size()));
+        if (num_read) {
+          cdc_write(
+              itf,
+              ResultView{.type_ = kRomData,
+                         .response_ = std::string_view(
+                             reinterpret_cast<const char*>(buf.data()),
+                             num_read)});
+        }
       } else {
-        std::vector<u8> buf(0x100);
-        const auto num_read = uart_rx_.read_buf(buf.data(), buf.size());
-        buf.resize(num_read);
-        if (buf.size()) {
-          dbg_println(std::format("host<{}", buf2hex(buf)));
-          cdc_write(itf, Result::new_ok(StatusCode::kRomFrame, buf2hex(buf))
-                             .to_usb_response());
+        std::array<u8, 0x100> buf;
+        const auto num_read = uart_rx_.read_buf(
+            buf.data(), cdc_frame_room(itf, buf.size() * 2) / 2);
+        if (num_read) {
+          std::array<char, buf.size() * 2> hex;
+          buf2hex(buf.data(), num_read, hex.data());
+          const auto hex_view = std::string_view(hex.data(), num_read * 2);
+          dbg_println("host<{}", hex_view);
+          cdc_write(itf, ResultView{.type_ = kOk,
+                                    .status_ = StatusCode::kRomFrame,
+                                    .response_ = hex_view});
         }
       }
     } while (time_us_32() - start < max_time_us);
+    if (host_stalled_ && !busy()) {
+      // the seq queue made room (or drained) for lines host already sent
+      cdc_rx(itf);
+    }
   }
 
   enum ResultType : u8 {
@@ -313,49 +702,58 @@ struct UcmdClientEmc {
     kInfo,
     kOk,
     kNg,
+    // raw rom bytes, no status
+    kRomData,
+    // raw memory contents (picoread), no status
+    kMemData,
+    // u64 time_us_64 at which the first byte of the next line was seen
+    kTimestamp,
+    // black box entry (picobb): u64 time_us_64 at which its first byte was
+    // seen, then the data
+    kBlackBox,
   };
+  // or'd into the frame type when a seq tag follows the length
+  static constexpr u8 kSeqFlag = 0x80;
 
-  struct Result {
-    static Result from_str(std::string_view str) {
+  // Non-owning Result, so lines can be parsed and framed without copying.
+  struct ResultView {
+    static ResultView from_str(std::string_view str) {
       // The parsing is a bit ghetto, but works
 
       // comments are just a string
       // e.g. # [PSQ] [BT WAKE Disabled Start]
       if (str.size() > 2 && str.starts_with("# ")) {
-        auto response = std::string(str.substr(2));
-        return {.type_ = kComment,
-                .status_ = kInvalidStatus,
-                .response_ = response};
+        return {.type_ = kComment, .response_ = str.substr(2)};
       }
       // same with info lines...
       // e.g. $$ [MANU] PG2 ON
       if (str.size() > 3 && str.starts_with("$$ ")) {
-        auto response = std::string(str.substr(3));
-        return {
-            .type_ = kInfo, .status_ = kInvalidStatus, .response_ = response};
+        return {.type_ = kInfo, .response_ = str.substr(3)};
       }
 
+      const ResultView unknown{.type_ = kUnknown, .response_ = str};
+
       // OK/NG must have status with optional string
       const auto status_offset = 2 + 1;
       const auto status_end = status_offset + 8;
       if (str.size() < status_end) {
-        return new_unknown(str);
+        return unknown;
       }
       bool is_ok = str.starts_with("OK ");
       bool is_ng = str.starts_with("NG ");
       if (!is_ok && !is_ng) {
-        return new_unknown(str);
+        return unknown;
       }
 
       auto status = int_from_hex<u32>(str, status_offset);
       if (!status.has_value()) {
-        return new_unknown(str);
+        return unknown;
       }
 
-      std::string response;
+      std::string_view response;
       if (str.size() > status_end) {
         if (str[status_end] != ' ') {
-          return new_unknown(str);
+          return unknown;
         }
         response = str.substr(status_end + 1);
       }
@@ -364,6 +762,23 @@ struct UcmdClientEmc {
               .status_ = status.value(),
               .response_ = response};
     }
+    bool is_ok_or_ng() const { return type_ == kOk || type_ == kNg; }
+
+    enum : u32 { kInvalidStatus = UINT32_MAX };
+    ResultType type_{kTimeout};
+    u32 status_{kInvalidStatus};
+    std::string_view response_;
+    // set for the echo and status of pipelined cmds
+    std::optional<u32> seq_;
+  };
+
+  struct Result {
+    static Result from_str(std::string_view str) {
+      const auto view = ResultView::from_str(str);
+      return {.type_ = view.type_,
+              .status_ = view.status_,
+              .response_ = std::string(view.response_)};
+    }
     static Result new_timeout() {
       return {.type_ = kTimeout, .status_ = kInvalidStatus};
     }
@@ -404,137 +819,213 @@ struct UcmdClientEmc {
         return "timeout";
       }
     }
-    std::vector<u8> to_usb_response() const {
-      auto response_len = response_.size();
-      if (is_ok_or_ng()) {
-        response_len += sizeof(status_);
-      }
+    ResultView view() const {
+      return {.type_ = type_, .status_ = status_, .response_ = response_};
+    }
+
+    enum : u32 { kInvalidStatus = ResultView::kInvalidStatus };
+    ResultType type_{kTimeout};
+    u32 status_{kInvalidStatus};
+    std::string response_;
+  };
 
-      std::vector<u8> data(sizeof(type_) + sizeof(response_len) + response_len);
-      size_t pos = 0;
+  // returns false if host went away
+  bool cdc_write(u8 itf, const void* buf, size_t len) {
+    return cdc_write_all(itf, buf, len);
+  }
 
-      std::memcpy(&data[0], &type_, sizeof(type_));
-      pos += sizeof(type_);
+  // Frame is: u8 type, u32 len, [u32 seq if type & kSeqFlag], [u32 status if
+  // ok/ng], response (len includes seq and status). Written straight into the
+  // cdc fifo.
+  void cdc_write(u8 itf, const ResultView& result) {
+    struct [[gnu::packed]] {
+      u8 type;
+      u32 len;
+      u32 words[2];
+    } hdr{.type = result.type_,
+          .len = static_cast<u32>(result.response_.size())};
+    size_t num_words = 0;
+    if (result.seq_.has_value()) {
+      hdr.type |= kSeqFlag;
+      hdr.words[num_words++] = result.seq_.value();
+    }
+    if (result.is_ok_or_ng()) {
+      hdr.words[num_words++] = result.status_;
+    }
+    hdr.len += num_words * sizeof(u32);
+    const size_t hdr_len =
+        offsetof(decltype(hdr), words) + num_words * sizeof(u32);
+    if (!cdc_write(itf, &hdr, hdr_len) ||
+        !cdc_write(itf, result.response_.data(), result.response_.size())) {
+      return;
+    }
+    CdcPort::write_flush(itf);
+  }
 
-      std::memcpy(&data[pos], &response_len, sizeof(response_len));
-      pos += sizeof(response_len);
+  void cdc_write(u8 itf, const Result& result) { cdc_write(itf, result.view()); }
 
-      if (is_ok_or_ng()) {
-        std::memcpy(&data[pos], &status_, sizeof(status_));
-        pos += sizeof(status_);
-      }
+  // type, len, seq, status
+  static constexpr size_t kFrameHeaderMax = 1 + 4 + 2 * 4;
 
-      std::memcpy(&data[pos], &response_[0], response_.size());
-      return data;
+  // True if frames with num_frames headers and len response bytes can be
+  // queued to usb without waiting. While the host isn't reading, emc output
+  // then waits in the rx ring instead of the loop spinning on usb. Frames
+  // which could never fit (and writes to a gone host) are let through.
+  static bool cdc_frames_fit(u8 itf, size_t len, size_t num_frames = 1) {
+    const size_t frames_len = num_frames * kFrameHeaderMax + len;
+    return frames_len > CdcPort::kWriteCapacity || !CdcPort::connected(itf) ||
+           CdcPort::write_available(itf) >= frames_len;
+  }
+  // response bytes which can be queued in one frame without waiting
+  static size_t cdc_frame_room(u8 itf, size_t max_len) {
+    if (!CdcPort::connected(itf)) {
+      return max_len;
     }
+    const size_t avail = CdcPort::write_available(itf);
+    return avail > kFrameHeaderMax ? std::min(avail - kFrameHeaderMax, max_len)
+                                   : 0;
+  }
 
-    enum { kInvalidStatus = UINT32_MAX };
-    ResultType type_{kTimeout};
-    u32 status_{kInvalidStatus};
-    std::string response_;
+  // Time spent framing and queueing emc lines to usb, from the RP2040 timer.
+  // A frame often takes less than its 1us tick, so the average is only
+  // meaningful over many frames. Reported in clk_sys cycles.
+  struct FrameStats {
+    void add(u32 start_us, u32 end_us) {
+      const u32 us = end_us - start_us;
+      total_us += us;
+      max_us = std::max(max_us, us);
+      num_frames++;
+    }
+    static u32 cycles_per_us() { return clock_get_hz(clk_sys) / 1'000'000; }
+    u32 avg_cycles() const {
+      return num_frames ? total_us * cycles_per_us() / num_frames : 0;
+    }
+    u32 max_cycles() const { return max_us * cycles_per_us(); }
+    u32 num_frames{};
+    u32 max_us{};
+    u64 total_us{};
   };
 
-  void dbg_println(const std::string& str, bool newline = true) {
+  // Arguments are still evaluated in release builds, so pass views rather
+  // than building strings for them.
+  template <typename... Args>
+  void dbg_println(std::format_string<Args...> fmt, Args&&... args) {
 #ifdef ENABLE_DEBUG_STDIO
-    if (newline) {
-      puts(str.c_str());
-    } else {
-      printf("%s", str.c_str());
-    }
+    puts(std::format(fmt, std::forward<Args>(args)...).c_str());
+#endif
+  }
+  template <typename... Args>
+  void dbg_print(std::format_string<Args...> fmt, Args&&... args) {
+#ifdef ENABLE_DEBUG_STDIO
+    printf("%s", std::format(fmt, std::forward<Args>(args)...).c_str());
 #endif
   }
 
   // read lines until one starts with "(OK|NG) <status>..."
-  Result read_result(u32 timeout_us) {
+  Task<Result> read_result(u32 timeout_us) {
     std::string line;
-    while (read_line(&line, timeout_us)) {
+    while (co_await read_line(&line, timeout_us)) {
       auto result = Result::from_str(line);
       if (result.is_ok_or_ng()) {
-        return result;
+        co_return result;
       }
-      dbg_println(result.format(), false);
+#ifdef ENABLE_DEBUG_STDIO
+      dbg_print("{}", result.format());
+#endif
     }
-    return Result::new_timeout();
+    co_return Result::new_timeout();
   }
 
   // reset the rx statemachine
-  void nak() {
-    write_str_blocking("\x15");
-    busy_wait_ms(10);
+  Task<> nak() {
+    write_str("\x15");
+    co_await runner_.sleep_ms(10);
   }
 
-  // returns false if echo readback failed
-  bool cmd_send(const std::string& cmdline, bool wait_echo = true) {
+  // post cmd only. host_us is when host handed it over, for tracing
+  void cmd_write(const std::string& cmdline, u32 host_us = time_us_32()) {
     // NOTE checksum could be fully disabled via nvs (va: 0xa09 {id:1,offset:9})
     auto cmd = cmdline + std::format(":{:02X}\n", checksum(cmdline));
-    write_str_blocking(cmd, wait_echo);
-    if (!wait_echo) {
-      return true;
+    tracer_.sent(cmdline, host_us);
+    write_str(cmd);
+  }
+
+  // returns false if echo readback failed
+  Task<bool> cmd_send(std::string cmdline) {
+    cmd_write(cmdline);
+    // the echo timeout starts once the cmd is on the wire
+    while (uart_.tx_busy()) {
+      co_await runner_.yield();
     }
     // wait for echo
-    const u32 timeout = cmd.size() * 200;
+    const u32 timeout = (cmdline.size() + 4) * 200;
     std::string readback;
-    while (read_line(&readback, timeout)) {
+    while (co_await read_line(&readback, timeout)) {
       if (readback == cmdline) {
-        return true;
+        co_return true;
       }
-      dbg_println(std::format("discard {}", readback));
+      dbg_println("discard {}", readback);
     }
-    return false;
+    co_return false;
   }
 
-  Result cmd_send_recv(const std::string& cmdline, u32 timeout_us = 10'000) {
-    dbg_println(std::format("> {}", cmdline), false);
-    if (!cmd_send(cmdline)) {
+  Task<Result> cmd_send_recv(std::string cmdline, u32 timeout_us = 10'000) {
+    dbg_print("> {}", cmdline);
+    if (!co_await cmd_send(cmdline)) {
       dbg_println("<echo readback timeout");
-      return Result::new_timeout();
+      co_return Result::new_timeout();
     }
-    auto result = read_result(timeout_us);
-    dbg_println(std::format("< {}", result.format()));
-    return result;
+    auto result = co_await read_result(timeout_us);
+#ifdef ENABLE_DEBUG_STDIO
+    dbg_println("< {}", result.format());
+#endif
+    co_return result;
   }
 
-  Result version() { return cmd_send_recv("version"); }
-  Result getserialno() { return cmd_send_recv("getserialno"); }
+  Task<Result> version() { return cmd_send_recv("version"); }
+  Task<Result> getserialno() { return cmd_send_recv("getserialno"); }
 
-  bool puareq1(u32 index) {
+  Task<bool> puareq1(u32 index) {
     // ignore the response (challenge data)
     // NOTE this response takes ~160ms
-    return cmd_send_recv(std::format("puareq1 {:x}", index), 200'000)
-        .is_success();
+    const auto result =
+        co_await cmd_send_recv(std::format("puareq1 {:x}", index), 200'000);
+    co_return result.is_success();
   }
 
-  bool puareq2(u32 index, const std::vector<u8>& chunk) {
+  Task<bool> puareq2(u32 index, const std::vector<u8>& chunk) {
     // ignore the response (index)
-    return cmd_send_recv(std::format("puareq2 {:x} {}", index, buf2hex(chunk)))
-        .is_success();
+    const auto result = co_await cmd_send_recv(
+        std::format("puareq2 {:x} {}", index, buf2hex(chunk)));
+    co_return result.is_success();
   }
 
-  Result resolve_constants() {
+  Task<Result> resolve_constants() {
     if (fw_consts_valid_) {
-      return Result::new_success();
+      co_return Result::new_success();
     }
-    auto result = version();
+    auto result = co_await version();
     if (!result.is_success()) {
-      return Result::new_ng(StatusCode::kFwConstsVersionFailed,
-                            result.format());
+      co_return Result::new_ng(StatusCode::kFwConstsVersionFailed,
+                               result.format());
     }
     const auto& version_str = result.response_;
     auto fw_consts_it = fw_constants_map.find(version_str);
     if (fw_consts_it == fw_constants_map.end()) {
-      return Result::new_ng(StatusCode::kFwConstsVersionUnknown, version_str);
+      co_return Result::new_ng(StatusCode::kFwConstsVersionUnknown,
+                               version_str);
     }
     fw_consts_ = fw_consts_it->second;
     fw_consts_valid_ = true;
-    return Result::new_success();
+    co_return Result::new_success();
   }
 
-  Result set_payload(const std::vector<u8>& payload) {
-    nak();
+  Task<Result> set_payload(const std::vector<u8>& payload) {
+    co_await nak();
     // Need to ask for first part of challenge once to enable response
     // processing
-    if (!puareq1(0)) {
-      return Result::new_ng(StatusCode::kSetPayloadPuareq1Failed);
+    if (!co_await puareq1(0)) {
+      co_return Result::new_ng(StatusCode::kSetPayloadPuareq1Failed);
     }
     // Place payload. We must fit within 7 chunks of 50 bytes each.
     // The total size must be multiple of 50 bytes. Assume caller does this.
@@ -543,11 +1034,11 @@ struct UcmdClientEmc {
     for (size_t pos = 0, idx = 0; pos < payload_len; pos += chunk_len, idx++) {
       std::vector<u8> chunk(&payload[pos],
                             &payload[std::min(pos + chunk_len, payload_len)]);
-      if (!puareq2(idx, chunk)) {
-        return Result::new_ng(StatusCode::kSetPayloadPuareq2Failed);
+      if (!co_await puareq2(idx, chunk)) {
+        co_return Result::new_ng(StatusCode::kSetPayloadPuareq2Failed);
       }
     }
-    return Result::new_success();
+    co_return Result::new_success();
   }
 
   template <typename T>
@@ -556,7 +1047,7 @@ struct UcmdClientEmc {
     return x + (align - rem);
   }
 
-  Result craft_and_set_payload() {
+  Task<Result> craft_and_set_payload() {
     // shove payload into ucmd_ua_buf
     // 0x184 byte buffer, we can control up to 350 bytes (must avoid sending
     // last chunk)
@@ -581,7 +1072,7 @@ struct UcmdClientEmc {
     const size_t payload_len =
         sizeof(payload_prefix) + fw_consts_.shellcode.size();
     if (payload_len > payload_max_len) {
-      return Result::new_ng(StatusCode::kSetPayloadTooLarge);
+      co_return Result::new_ng(StatusCode::kSetPayloadTooLarge);
     }
 
     std::vector<u8> payload;
@@ -591,18 +1082,18 @@ struct UcmdClientEmc {
     std::memcpy(&payload[sizeof(payload_prefix)], &fw_consts_.shellcode[0],
                 fw_consts_.shellcode.size());
 
-    return set_payload(payload);
+    co_return co_await set_payload(payload);
   }
 
-  Result is_unlocked() {
-    nak();
+  Task<Result> is_unlocked() {
+    co_await nak();
     // getserialno will work if shellcode ran
-    return getserialno();
+    co_return co_await getserialno();
   }
 
-  void write_oob(const std::array<u8, 4>& value) {
+  Task<> write_oob(const std::array<u8, 4>& value) {
     // Need emc to start processing the following data fresh
-    nak();
+    co_await nak();
 
     // The exploit relies on sending non-ascii chars to overwrite pointer after
     // the recv buffer. Unfortunately, for some fw versions, ucmd_ua_buf_addr
@@ -638,30 +1129,47 @@ struct UcmdClientEmc {
     // NAK: reset rx statemachine
     output2 += "\x15";
 
+    // What's timed is from the last filler byte on the wire to output2, so
+    // the filler goes out through the tx ring while other work carries on.
+    // Only once kOobTxSlack bytes are left does the loop block, so the
+    // stream must not run dry while we're waiting to be resumed.
+    co_await write_str_yielding(output);
+    while (uart_.tx_queued() > kOobTxSlack) {
+      co_await runner_.yield();
+    }
+    if (!uart_.tx_busy()) {
+      // resumed too late: the filler went out with a gap
+      num_oob_underruns_++;
+    }
     // TODO should interrupts be disabled? There doesn't seem to be a problem in
     // practice.
-    write_str_blocking(output);
+    uart_.flush_blocking();
 
-    // The important timer to tweak
+    // The important timer to tweak. Stays a busy wait: it's short, and must
+    // not be stretched by whatever else the main loop is doing.
     busy_wait_us(chip_consts_.pwn_delay_us);
 
     write_str_blocking(output2);
 
     // give some time for emc to process
-    busy_wait_ms(chip_consts_.post_process_ms);
+    co_await runner_.sleep_ms(chip_consts_.post_process_ms);
     // emc will also spew kRxInputTooLong errors, so need to discard all that
     // before continuing.
     uart_rx_.clear();
   }
 
-  bool overwrite_cmd_table_ptr() {
+  // ~5ms at 115200, plus what's in the fifo
+  static constexpr size_t kOobTxSlack = 64;
+  u32 num_oob_underruns_{};
+
+  Task<bool> overwrite_cmd_table_ptr() {
     const u32 write_val = fw_consts_.ucmd_ua_buf_addr;
     std::array<u8, sizeof(write_val)> target;
     for (size_t i = 0; i < target.size(); i++) {
       const u8 b = (write_val >> (i * 8)) & 0xff;
       // just avoid special chars
       if (b == '\b' || b == '\r' || b == '\n' || b == '\x15') {
-        return false;
+        co_return false;
       }
       target[i] = b;
     }
@@ -674,73 +1182,73 @@ struct UcmdClientEmc {
         for (size_t j = 0; j < pos + 1; j++) {
           to_send[j] = 0;
         }
-        write_oob(to_send);
+        co_await write_oob(to_send);
       }
     }
-    write_oob(target);
-    return true;
+    co_await write_oob(target);
+    co_return true;
   }
 
-  Result exploit_setup() {
+  Task<Result> exploit_setup() {
     // This only needs to be done once (result cached)
-    auto result = resolve_constants();
+    auto result = co_await resolve_constants();
     if (!result.is_success()) {
-      return result;
+      co_return result;
     }
 
     // Needs to be done once per emc boot
-    result = craft_and_set_payload();
+    result = co_await craft_and_set_payload();
     if (!result.is_success()) {
-      return result;
+      co_return result;
     }
 
-    if (!overwrite_cmd_table_ptr()) {
-      return Result::new_ng(StatusCode::kFwConstsInvalid);
+    if (!co_await overwrite_cmd_table_ptr()) {
+      co_return Result::new_ng(StatusCode::kFwConstsInvalid);
     }
-    return Result::new_success();
+    co_return Result::new_success();
   }
 
-  Result exploit_trigger() {
+  Task<Result> exploit_trigger() {
     // If cmd table ptr was modified, version will no longer be valid cmd
     // NOTE emc could crash here if ptr was incorrectly overwritten
-    nak();
-    auto result = version();
+    co_await nak();
+    auto result = co_await version();
     if (!result.is_ng_status(StatusCode::kUcmdUnknownCmd)) {
-      return Result::new_ng(StatusCode::kExploitVersionUnexpected,
-                            result.format());
+      co_return Result::new_ng(StatusCode::kExploitVersionUnexpected,
+                               result.format());
     }
 
     // trigger shellcode
     // the shellcode isn't expected to send a response
     // technically should insert respone to ensure it has executed, but in
     // practice hasn't been a problem.
-    cmd_send(hax_cmd_name_);
+    co_await cmd_send(hax_cmd_name_);
 
-    return is_unlocked();
+    co_return co_await is_unlocked();
   }
 
-  Result autorun() {
+  Task<Result> autorun() {
     if (reset_.is_reset()) {
-      return Result::new_ng(StatusCode::kEmcInReset);
+      co_return Result::new_ng(StatusCode::kEmcInReset);
     }
 
     // something (e.g. powerup) could have put cmd response on the wire already
     uart_rx_.clear();
 
     // already done? skip
-    auto result = is_unlocked();
+    auto result = co_await is_unlocked();
     if (result.is_success()) {
-      return Result::new_success();
+      co_return Result::new_success();
     }
 
-    result = exploit_setup();
+    result = co_await exploit_setup();
     if (result.is_ng()) {
-      return result;
+      co_return result;
     }
 
-    result = exploit_trigger();
+    result = co_await exploit_trigger();
     if (result.is_success()) {
-      return Result::new_success();
+      co_return Result::new_success();
     }
     // NOTE crash recovery takes ~13 seconds and console replies:
     // "OK 00000000:3A\n$$ [MANU] UART CMD READY:36" afterwards
@@ -754,7 +1262,7 @@ struct UcmdClientEmc {
     reset_.reset();
 
     // host should wait for success msg (~4.5seconds)
-    return Result::new_ng(StatusCode::kExploitFailedEmcReset);
+    co_return Result::new_ng(StatusCode::kExploitFailedEmcReset);
   }
 
   struct ChipConsts {
@@ -834,14 +1342,22 @@ struct UcmdClientEmc {
     return Result::new_success();
   }
 
-  Result rom_enter_exit(const std::string& cmd) {
+  Task<Result> rom_enter_exit(std::string cmd) {
     const auto ng = Result::new_ng(StatusCode::kUcmdUnknownCmd);
     const auto parts = split_string(cmd, ' ');
-    if (parts.size() != 2) {
-      return ng;
+    if (parts.size() < 2 || parts.size() > 3) {
+      co_return ng;
     }
     const auto mode = parts[1];
     if (mode == "enter") {
+      bool binary = false;
+      if (parts.size() == 3) {
+        if (parts[2] != "bin") {
+          co_return ng;
+        }
+        binary = true;
+      }
+
       reset_.set_low();
       const auto reset_release = make_timeout_time_us(100);
       rom_gpio_.set_low();
@@ -849,12 +1365,13 @@ struct UcmdClientEmc {
       uart_.set_baudrate(460800);
       uart_rx_.clear();
 
-      busy_wait_until(reset_release);
+      co_await runner_.sleep_until(reset_release);
       in_rom_ = true;
+      rom_binary_ = binary;
       reset_.release();
 
-      return Result::new_success();
-    } else if (mode == "exit") {
+      co_return Result::new_success();
+    } else if (mode == "exit" && parts.size() == 2) {
       reset_.set_low();
       const auto reset_release = make_timeout_time_us(100);
       rom_gpio_.release();
@@ -862,22 +1379,572 @@ struct UcmdClientEmc {
       uart_.set_baudrate(115200);
       uart_rx_.clear();
 
-      busy_wait_until(reset_release);
+      co_await runner_.sleep_until(reset_release);
       in_rom_ = false;
+      rom_binary_ = false;
       reset_.release();
 
-      return Result::new_success();
+      co_return Result::new_success();
     }
-    return ng;
+    co_return ng;
   }
 
-  enum CommandType {
-    kUnlock,
-    kPicoReset,
-    kEmcReset,
-    kEmcRom,
-    kSetFwConsts,
-    kSetChipConsts,
+  // picostats
+  // Response is space separated "<name>=<value>" (decimal) pairs. Counters
+  // are free running u32s, so they wrap.
+  Result stats() const {
+    std::string str;
+    const auto add = [&](std::string_view prefix, std::string_view name,
+                         u64 val) {
+      str += std::format("{}{}.{}={}", str.empty() ? "" : " ", prefix, name,
+                         val);
+    };
+    const auto add_uart = [&](std::string_view prefix, const Uart& uart,
+                              const auto& rx) {
+      add(prefix, "rx_bytes", rx.num_received.load());
+      add(prefix, "rx_size", rx.capacity());
+      add(prefix, "rx_high_water", rx.high_water.load());
+      add(prefix, "rx_dropped", rx.num_dropped.load());
+      add(prefix, "rx_watermark", rx.watermark);
+      add(prefix, "rx_backpressure", rx.num_backpressure);
+      add(prefix, "tx_bytes", uart.tx_stats().tx_bytes);
+      add(prefix, "tx_high_water", uart.tx_stats().tx_high_water);
+      const auto& errors = uart.errors();
+      add(prefix, "framing_errors", errors.framing.load());
+      add(prefix, "parity_errors", errors.parity.load());
+      add(prefix, "break_errors", errors.brk.load());
+      add(prefix, "overrun_errors", errors.overrun.load());
+    };
+    add_uart("emc", uart_, uart_rx_);
+    add("emc", "bad_lines", uart_rx_.num_bad_lines);
+    add("emc", "oob_underruns", num_oob_underruns_);
+    add("emc", "frame_avg_cycles", frame_stats_.avg_cycles());
+    add("emc", "frame_max_cycles", frame_stats_.max_cycles());
+    add("emc", "blackbox_overwritten", blackbox_.num_overwritten());
+    add_uart("efc", efc_->uart_, efc_->uart_rx_);
+    add("efc", "blackbox_overwritten", efc_->blackbox_.num_overwritten());
+    for (size_t itf = 0; itf < s_usb_stats.size(); itf++) {
+      const auto& usb = s_usb_stats[itf];
+      const auto prefix = std::format("cdc{}", itf);
+      add(prefix, "rx_bytes", usb.rx_bytes);
+      add(prefix, "tx_bytes", usb.tx_bytes);
+      add(prefix, "write_stalls", usb.write_stalls);
+      add(prefix, "write_aborts", usb.write_aborts);
+    }
+    add("loop", "iterations", s_loop_stats.num_iterations);
+    add("loop", "avg_us",
+        s_loop_stats.num_iterations
+            ? s_loop_stats.total_us / s_loop_stats.num_iterations
+            : 0);
+    add("loop", "max_us", s_loop_stats.max_us);
+    return Result::new_success(str);
+  }
+
+  // picots <emc|efc> <0|1>
+  // emc: each emc line frame is preceded by a kTimestamp frame.
+  // efc: titania output is sent in chunks, each preceded by Efc::ChunkHeader.
+  Result set_timestamps(const std::string& cmd) {
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() != 3 || (parts[2] != "0" && parts[2] != "1")) {
+      return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    const bool enable = parts[2] == "1";
+    if (parts[1] == "emc") {
+      timestamps_ = enable;
+    } else if (parts[1] == "efc") {
+      efc_->timestamps_ = enable;
+    } else {
+      return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    return Result::new_success();
+  }
+
+  // picobp <emc|efc> <watermark hex>
+  // Backpressure instead of loss: while more than watermark bytes of output
+  // wait in the rx ring (the usb host isn't keeping up), stop feeding the
+  // other end. emc: no new cmds are sent. efc: host data isn't passed to
+  // titania. 0 turns it off.
+  Result set_backpressure(const std::string& cmd) {
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() != 3) {
+      return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    const auto watermark = int_from_hex<u32>(parts[2]);
+    if (!watermark.has_value()) {
+      return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    if (parts[1] == "emc" && watermark.value() < uart_rx_.capacity()) {
+      uart_rx_.watermark = watermark.value();
+    } else if (parts[1] == "efc" &&
+               watermark.value() < efc_->uart_rx_.capacity()) {
+      efc_->uart_rx_.watermark = watermark.value();
+    } else {
+      return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    return Result::new_success();
+  }
+
+  // picolat [trace|clear]
+  // Without args, dumps the per cmd latency histograms as comments:
+  // "<cmd name> <phase> <count per bucket..>", see CmdTracer.
+  // trace dumps the most recent cmds (times in us, relative to arrival).
+  Result latency(u8 itf, const std::string& cmd) {
+    const auto parts = split_string(cmd, ' ');
+    const auto output = [&](const std::string& line) {
+      cdc_write(itf, ResultView{.type_ = kComment, .response_ = line});
+    };
+    if (parts.size() == 1) {
+      tracer_.dump_histograms(output);
+    } else if (parts.size() == 2 && parts[1] == "trace") {
+      tracer_.dump_trace(output);
+    } else if (parts.size() == 2 && parts[1] == "clear") {
+      tracer_.clear();
+    } else {
+      return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    return Result::new_success();
+  }
+
+  // picobb <emc|efc> [clear]
+  // Dumps the channel's black box, oldest first, as kBlackBox frames: emc
+  // lines (checksum removed) or chunks of titania output, recorded whether or
+  // not a host was connected. clear empties it instead.
+  // Entries recorded during the dump aren't included.
+  Task<Result> blackbox(u8 itf, std::string cmd) {
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() < 2 || parts.size() > 3 ||
+        (parts.size() == 3 && parts[2] != "clear")) {
+      co_return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    UartBlackBox* box = nullptr;
+    if (parts[1] == "emc") {
+      box = &blackbox_;
+    } else if (parts[1] == "efc") {
+      box = &efc_->blackbox_;
+    } else {
+      co_return Result::new_ng(StatusCode::kUcmdEINVAL);
+    }
+    if (parts.size() == 3) {
+      box->clear();
+      co_return Result::new_success();
+    }
+    const u32 end = box->end_index();
+    auto cursor = box->begin();
+    std::string entry;
+    u64 time_us;
+    while (static_cast<s32>(end - cursor.index) > 0 &&
+           box->read(&cursor, &time_us, &entry)) {
+      entry.insert(0, reinterpret_cast<const char*>(&time_us), sizeof(time_us));
+      // waiting here rather than in cdc_write keeps usb serviced
+      while (!cdc_frames_fit(itf, entry.size())) {
+        co_await runner_.yield();
+      }
+      cdc_write(itf, ResultView{.type_ = kBlackBox, .response_ = entry});
+    }
+    co_return Result::new_success();
+  }
+
+  // fcddrr output is "# <addr>: <word> <word>..", words being hex values which
+  // are stored little endian
+  static bool parse_hexdump_line(std::string_view line, std::vector<u8>* buf) {
+    const auto colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      return false;
+    }
+    for (size_t pos = colon + 1; pos < line.size();) {
+      if (line[pos] == ' ') {
+        pos++;
+        continue;
+      }
+      const auto word_end = std::min(line.find(' ', pos), line.size());
+      const auto word = line.substr(pos, word_end - pos);
+      const auto val = int_from_hex<u32>(word);
+      if (!val.has_value() || word.size() > 8 || (word.size() & 1)) {
+        return false;
+      }
+      for (size_t i = 0; i < word.size() / 2; i++) {
+        buf->push_back(val.value() >> (i * 8));
+      }
+      pos = word_end;
+    }
+    return true;
+  }
+
+  // emc only puts the final OK on its own line when the size is a multiple of
+  // this
+  static constexpr u32 kFcddrrAlign = 0x10;
+  static constexpr u32 kMemReadChunk = 0x1000;
+  static constexpr u32 kMemReadLineTimeoutUs = 100'000;
+
+  Task<Result> fcddrr(u32 addr, u32 size, std::vector<u8>* buf) {
+    buf->clear();
+    if (!co_await cmd_send(std::format("fcddrr {:x} {:x}", addr, size))) {
+      co_return Result::new_timeout();
+    }
+    std::string line;
+    while (co_await read_line(&line, kMemReadLineTimeoutUs)) {
+      const auto view = ResultView::from_str(line);
+      if (view.is_ok_or_ng()) {
+        co_return Result::from_str(line);
+      }
+      if (view.type_ == kComment) {
+        parse_hexdump_line(view.response_, buf);
+      }
+    }
+    co_return Result::new_timeout();
+  }
+
+  // picoread <addr> <size> [chunk]
+  // Reads emc memory via fcddrr, parsing the hexdump here. The bytes arrive as
+  // one kMemData frame per chunk, followed by the status.
+  Task<Result> mem_read(u8 itf, std::string cmd) {
+    const auto ng = Result::new_ng(StatusCode::kUcmdEINVAL);
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() < 3 || parts.size() > 4) {
+      co_return ng;
+    }
+    const auto addr = int_from_hex<u32>(parts[1]);
+    const auto size = int_from_hex<u32>(parts[2]);
+    const auto chunk = parts.size() == 4 ? int_from_hex<u32>(parts[3])
+                                         : std::optional<u32>{kMemReadChunk};
+    if (!addr.has_value() || !size.has_value() || !chunk.has_value() ||
+        !chunk.value() || chunk.value() % kFcddrrAlign ||
+        static_cast<u64>(addr.value()) + size.value() > UINT32_MAX) {
+      co_return ng;
+    }
+    const u32 end = addr.value() + size.value();
+    const u32 aligned_start = addr.value() & ~3;
+    const u32 aligned_size =
+        (end - aligned_start + kFcddrrAlign - 1) & ~(kFcddrrAlign - 1);
+
+    std::vector<u8> buf;
+    for (u32 offset = 0; offset < aligned_size; offset += chunk.value()) {
+      const u32 pos = aligned_start + offset;
+      const u32 len = std::min(chunk.value(), aligned_size - offset);
+      const auto result = co_await fcddrr(pos, len, &buf);
+      if (!result.is_success()) {
+        co_return result;
+      }
+      if (buf.size() < len) {
+        co_return Result::new_ng(StatusCode::kMemReadShort);
+      }
+      const u32 lo = std::max(pos, addr.value());
+      const u32 hi = std::min(pos + len, end);
+      if (lo < hi) {
+        cdc_write(itf, ResultView{.type_ = kMemData,
+                                  .response_ = std::string_view(
+                                      reinterpret_cast<const char*>(
+                                          &buf[lo - pos]),
+                                      hi - lo)});
+      }
+    }
+    co_return Result::new_success();
+  }
+
+  // image bytes streamed by host after an xmodem cmd: whatever followed the
+  // cmd line first, then the cdc fifo
+  struct HostImage {
+    size_t read_data(u8* buf, size_t len) {
+      size_t num_read = std::min(len, pending.size());
+      std::memcpy(buf, pending.data(), num_read);
+      pending.erase(0, num_read);
+      if (num_read < len) {
+        num_read += CdcPort::read(itf, &buf[num_read], len - num_read);
+      }
+      return num_read;
+    }
+    std::string& pending;
+    u8 itf;
+  };
+
+  // Io for XmodemSender: the image comes from host, the handshake from the rom
+  struct XmodemIo {
+    size_t read_data(u8* buf, size_t len) { return image.read_data(buf, len); }
+    bool read_byte(u8* b) { return emc.uart_rx_.read_buf(b, 1) == 1; }
+    void write(const u8* buf, size_t len) { emc.uart_.write(buf, len); }
+    UcmdClientEmc& emc;
+    HostImage image;
+  };
+
+  Task<std::optional<u32>> fcddrr32(u32 addr) {
+    std::vector<u8> buf;
+    const auto result = co_await fcddrr(addr, kFcddrrAlign, &buf);
+    if (!result.is_success() || buf.size() < sizeof(u32)) {
+      co_return std::nullopt;
+    }
+    u32 val;
+    std::memcpy(&val, buf.data(), sizeof(val));
+    co_return val;
+  }
+
+  // returns false if host stopped sending
+  Task<bool> host_read(HostImage& image, u8* buf, size_t len) {
+    u32 start = time_us_32();
+    while (len) {
+      const auto num_read = image.read_data(buf, len);
+      buf += num_read;
+      len -= num_read;
+      if (num_read) {
+        start = time_us_32();
+      } else if (time_us_32() - start >= kHostDataTimeoutUs) {
+        co_return false;
+      }
+      if (len) {
+        co_await runner_.yield();
+      }
+    }
+    co_return true;
+  }
+  static constexpr u32 kHostDataTimeoutUs = 1'000'000;
+
+  // picowrite <addr> <size>
+  // The host sends size bytes right after the cmd line. They're written with
+  // fcddrw, each sent as soon as the previous one is echoed; partial words at
+  // either end are read first and merged. If any word failed, the status is NG
+  // kMemWriteFailed with a hex bitmap of failed words (bit n = word n, lsb
+  // first) as response.
+  Task<Result> mem_write(u8 itf, std::string cmd) {
+    const auto ng = Result::new_ng(StatusCode::kUcmdEINVAL);
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() != 3) {
+      co_return ng;
+    }
+    const auto addr = int_from_hex<u32>(parts[1]);
+    const auto size = int_from_hex<u32>(parts[2]);
+    if (!addr.has_value() || !size.has_value() ||
+        static_cast<u64>(addr.value()) + size.value() > UINT32_MAX) {
+      co_return ng;
+    }
+    if (!size.value()) {
+      co_return Result::new_success();
+    }
+    const u32 end = addr.value() + size.value();
+    const u32 aligned_start = addr.value() & ~3;
+    const u32 num_words = (end - aligned_start + 3) / 4;
+
+    std::vector<u8> failed((num_words + 7) / 8);
+    bool any_failed = false;
+    auto set_failed = [&](u32 index) {
+      failed[index / 8] |= 1 << (index % 8);
+      any_failed = true;
+    };
+    // word indices sent and echoed, waiting for OK/NG
+    std::deque<u32> pending;
+    auto on_line = [&](const std::string& line) {
+      const auto view = ResultView::from_str(line);
+      if (!view.is_ok_or_ng() || pending.empty()) {
+        return;
+      }
+      if (view.type_ != kOk) {
+        set_failed(pending.front());
+      }
+      pending.pop_front();
+    };
+
+    // read-modify-write for partial words, before anything is written
+    std::optional<u32> head, tail;
+    if (addr.value() & 3) {
+      head = co_await fcddrr32(aligned_start);
+    }
+    if (end & 3) {
+      if (num_words == 1 && (addr.value() & 3)) {
+        tail = head;
+      } else {
+        tail = co_await fcddrr32(end & ~3);
+      }
+    }
+
+    HostImage image{host_line_, itf};
+    std::string line;
+    for (u32 i = 0; i < num_words; i++) {
+      const u32 word_addr = aligned_start + i * 4;
+      const u32 lo = std::max(word_addr, addr.value());
+      const u32 hi = std::min(word_addr + 4, end);
+      const bool partial = hi - lo < 4;
+      const auto orig = (i == 0 && (addr.value() & 3)) ? head : tail;
+      u32 val = (partial && orig.has_value()) ? orig.value() : 0;
+      if (!co_await host_read(image, reinterpret_cast<u8*>(&val) +
+                                         (lo - word_addr),
+                              hi - lo)) {
+        co_return Result::new_timeout();
+      }
+      if (partial && !orig.has_value()) {
+        set_failed(i);
+        continue;
+      }
+
+      const auto cmdline = std::format("fcddrw {:x} {:x}", word_addr, val);
+      cmd_write(cmdline);
+      while (uart_.tx_busy()) {
+        co_await runner_.yield();
+      }
+      // only the echo is waited for. statuses of earlier words turn up here
+      bool echoed = false;
+      while (co_await read_line(&line, (cmdline.size() + 4) * 200)) {
+        if (line == cmdline) {
+          echoed = true;
+          break;
+        }
+        on_line(line);
+      }
+      if (echoed) {
+        pending.push_back(i);
+      } else {
+        set_failed(i);
+      }
+    }
+    while (!pending.empty() &&
+           co_await read_line(&line, kMemReadLineTimeoutUs)) {
+      on_line(line);
+    }
+    for (const auto index : pending) {
+      set_failed(index);
+    }
+
+    if (any_failed) {
+      co_return Result::new_ng(StatusCode::kMemWriteFailed, buf2hex(failed));
+    }
+    co_return Result::new_success();
+  }
+
+  // an image is being streamed from host, to emc rom or titania bootrom
+  bool image_active() const {
+    return xmodem_.active() || efc_->boot_active();
+  }
+  const XmodemSender& image_xmodem() const {
+    return efc_->boot_active() ? efc_->boot_xmodem() : xmodem_;
+  }
+
+  // picoemcxm <size> [1k]
+  // The rom must already be waiting in xmodem (after "down"). Once the first
+  // progress comment arrives, the host sends size bytes of image. Progress
+  // keeps coming as comments, then the final status once the transfer is done.
+  Result xmodem_start(const std::string& cmd) {
+    const auto ng = Result::new_ng(StatusCode::kUcmdEINVAL);
+    if (!in_rom_) {
+      return ng;
+    }
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() < 2 || parts.size() > 3) {
+      return ng;
+    }
+    const auto size = int_from_hex<u32>(parts[1]);
+    if (!size.has_value()) {
+      return ng;
+    }
+    bool use_1k = false;
+    if (parts.size() == 3) {
+      if (parts[2] != "1k") {
+        return ng;
+      }
+      use_1k = true;
+    }
+    xmodem_.start(size.value(), use_1k);
+    return Result::new_success();
+  }
+
+  // picoefcboot <size>
+  // Same as picoemcxm, but the image goes to the titania bootrom on the efc
+  // uart (down, xmodem, run). The efc interface is paused meanwhile. If the
+  // rom printed a status, it's returned as the OK status.
+  Result efc_boot_start(const std::string& cmd) {
+    const auto ng = Result::new_ng(StatusCode::kUcmdEINVAL);
+    const auto parts = split_string(cmd, ' ');
+    if (parts.size() != 2) {
+      return ng;
+    }
+    const auto size = int_from_hex<u32>(parts[1]);
+    if (!size.has_value()) {
+      return ng;
+    }
+    efc_->boot_start(size.value());
+    return Result::new_success();
+  }
+
+  static u32 xmodem_status_code(XmodemSender::Status status) {
+    switch (status) {
+    case XmodemSender::kDone:
+      return StatusCode::kSuccess;
+    case XmodemSender::kNoStart:
+      return StatusCode::kXmodemNoStart;
+    case XmodemSender::kCancelled:
+      return StatusCode::kXmodemCancelled;
+    case XmodemSender::kHostTimeout:
+      return StatusCode::kXmodemHostTimeout;
+    default:
+      return StatusCode::kXmodemRetriesExceeded;
+    }
+  }
+
+  void xmodem_progress(u8 itf) {
+    const auto& xmodem = image_xmodem();
+    xmodem_progress_us_ = time_us_32();
+    cdc_write(itf, Result{.type_ = kComment,
+                          .response_ = std::format("xmodem {:x}/{:x}",
+                                                   xmodem.num_sent(),
+                                                   xmodem.size())});
+  }
+
+  std::optional<Result> xmodem_poll(HostImage& image) {
+    if (efc_->boot_active()) {
+      const auto boot = efc_->boot_poll(image);
+      if (!boot.has_value()) {
+        return {};
+      }
+      if (boot->rom_status.has_value()) {
+        return Result::new_ok(boot->rom_status.value());
+      }
+      if (boot->xmodem != XmodemSender::kDone) {
+        return Result::new_ng(xmodem_status_code(boot->xmodem));
+      }
+      return Result::new_success();
+    }
+    XmodemIo io{*this, image};
+    const auto status = xmodem_.poll(io);
+    if (status == XmodemSender::kBusy) {
+      return {};
+    }
+    if (status != XmodemSender::kDone) {
+      return Result::new_ng(xmodem_status_code(status));
+    }
+    return Result::new_success();
+  }
+
+  void xmodem_process(u8 itf, u32 max_time_us) {
+    HostImage image{host_line_, itf};
+    const u32 start = time_us_32();
+    std::optional<Result> result;
+    do {
+      result = xmodem_poll(image);
+    } while (!result.has_value() && time_us_32() - start < max_time_us);
+
+    if (!result.has_value()) {
+      if (time_us_32() - xmodem_progress_us_ >= 100'000) {
+        xmodem_progress(itf);
+      }
+      return;
+    }
+    cdc_write(itf, result.value());
+    // resume cmd processing with anything host queued after the image
+    cdc_rx(itf);
+  }
+
+  enum CommandType {
+    kUnlock,
+    kPicoReset,
+    kEmcReset,
+    kEmcRom,
+    kEmcXmodem,
+    kEfcBoot,
+    kMemRead,
+    kMemWrite,
+    kStats,
+    kLatency,
+    kTimestamps,
+    kBackpressure,
+    kBlackBoxDump,
+    kSetFwConsts,
+    kSetChipConsts,
     kPassthroughUcmd,
     kPassthroughRom,
   };
@@ -891,6 +1958,24 @@ struct UcmdClientEmc {
       return CommandType::kEmcReset;
     } else if (cmd.starts_with("picoemcrom")) {
       return CommandType::kEmcRom;
+    } else if (cmd.starts_with("picoemcxm")) {
+      return CommandType::kEmcXmodem;
+    } else if (cmd.starts_with("picoefcboot")) {
+      return CommandType::kEfcBoot;
+    } else if (cmd.starts_with("picoread")) {
+      return CommandType::kMemRead;
+    } else if (cmd.starts_with("picowrite")) {
+      return CommandType::kMemWrite;
+    } else if (cmd.starts_with("picostats")) {
+      return CommandType::kStats;
+    } else if (cmd.starts_with("picolat")) {
+      return CommandType::kLatency;
+    } else if (cmd.starts_with("picots")) {
+      return CommandType::kTimestamps;
+    } else if (cmd.starts_with("picobp")) {
+      return CommandType::kBackpressure;
+    } else if (cmd.starts_with("picobb")) {
+      return CommandType::kBlackBoxDump;
     } else if (cmd.starts_with("picofwconst")) {
       return CommandType::kSetFwConsts;
     } else if (cmd.starts_with("picochipconst")) {
@@ -902,29 +1987,231 @@ struct UcmdClientEmc {
     }
   }
 
+  // Binary rom lines from host are kRomLineMarker followed by the payload, with
+  // \n and kRomLineEscape bytes sent as {kRomLineEscape, byte ^ kRomLineXor}.
+  static constexpr char kRomLineMarker = '\x02';
+  static constexpr char kRomLineEscape = '\x1b';
+  static constexpr u8 kRomLineXor = 0x20;
+
+  static bool rom_unescape(std::string_view line, std::vector<u8>* buf) {
+    buf->clear();
+    buf->reserve(line.size());
+    for (size_t i = 0; i < line.size(); i++) {
+      u8 b = line[i];
+      if (b == kRomLineEscape) {
+        if (++i == line.size()) {
+          return false;
+        }
+        b = line[i] ^ kRomLineXor;
+      }
+      buf->push_back(b);
+    }
+    return true;
+  }
+
+  // usb -> emc. Complete lines are processed in order and a trailing partial
+  // line is kept until the rest arrives. Nothing more is read from usb while a
+  // complete line is waiting, so the host is throttled by the cdc fifo.
+  void cdc_rx(u8 itf) {
+    // HostImage pulls the image itself, or cmds wait for the running one
+    if (busy() || !process_host_lines(itf)) {
+      return;
+    }
+    const u32 avail = CdcPort::available(itf);
+    const size_t old_len = host_line_.size();
+    host_line_.resize(old_len + avail);
+    const u32 num_read = CdcPort::read(itf, &host_line_[old_len], avail);
+    host_line_.resize(old_len + num_read);
+
+    if (process_host_lines(itf) && !busy() &&
+        host_line_.size() > kHostLineMax) {
+      // no newline in sight, just toss it
+      host_line_.clear();
+    }
+  }
+
+  // returns false if a complete line had to be left for later
+  // Each line is removed before it's processed, so cmds which take data
+  // streamed after the cmd line find it at the start of host_line_.
+  bool process_host_lines(u8 itf) {
+    host_stalled_ = false;
+    for (size_t eol; (eol = host_line_.find('\n')) != std::string::npos;) {
+      if (!host_line_ready(host_line_)) {
+        host_stalled_ = true;
+        break;
+      }
+      const auto line = host_line_.substr(0, eol);
+      host_line_.erase(0, eol + 1);
+      process_host_line(itf, line);
+    }
+    return !host_stalled_;
+  }
+
+  bool is_seq_line(std::string_view line) const {
+    return !in_rom_ && line.starts_with(kSeqPrefix);
+  }
+
+  bool host_line_ready(std::string_view line) const {
+    if (busy() || uart_rx_.above_watermark()) {
+      return false;
+    }
+    if (is_seq_line(line)) {
+      return seq_queue_.size() < kSeqQueueMax;
+    }
+    // anything else would steal the emc output of queued cmds
+    return seq_idle();
+  }
+
+  void process_host_line(u8 itf, const std::string& line) {
+    if (is_seq_line(line)) {
+      seq_enqueue(itf, line);
+    } else {
+      process_cmd(itf, line);
+    }
+  }
+
+  // Pipelined ucmds: host lines "@<seq> <ucmd>" (seq in hex) are queued and
+  // each is sent to emc as soon as the echo of the previous one is seen,
+  // instead of after its status. The echo and OK/NG (or timeout) frames of
+  // each are tagged with seq. Untagged lines wait until the queue drains.
+  static constexpr char kSeqPrefix = '@';
+  static constexpr size_t kSeqQueueMax = 64;
+  static constexpr u32 kSeqEchoSlackUs = 10'000;
+  static constexpr u32 kSeqResultTimeoutUs = 5'000'000;
+
+  struct SeqCmd {
+    u32 seq{};
+    std::string cmd;
+    u32 deadline{};
+    u32 host_us{};
+  };
+
+  void seq_enqueue(u8 itf, std::string_view line) {
+    dbg_println("host>{}", line);
+    const auto seq = int_from_hex<u32>(line, 1);
+    const auto cmd_pos = line.find(' ');
+    if (!seq.has_value() || cmd_pos == std::string_view::npos) {
+      cdc_write(itf, Result::new_ng(StatusCode::kUcmdEINVAL));
+      return;
+    }
+    seq_queue_.push_back({.seq = seq.value(),
+                          .cmd = std::string(line.substr(cmd_pos + 1)),
+                          .host_us = time_us_32()});
+  }
+
+  bool seq_idle() const {
+    return seq_queue_.empty() && !seq_echo_.has_value() && seq_results_.empty();
+  }
+
+  static bool seq_expired(const SeqCmd& cmd) {
+    return static_cast<s32>(time_us_32() - cmd.deadline) >= 0;
+  }
+
+  void seq_timeout(u8 itf, u32 seq) {
+    cdc_write(itf, ResultView{.type_ = kTimeout, .seq_ = seq});
+  }
+
+  // sends the next queued cmd once the previous one was echoed, and gives up
+  // on cmds emc never answered
+  void seq_pump(u8 itf) {
+    if (seq_echo_.has_value() && seq_expired(seq_echo_.value())) {
+      seq_timeout(itf, seq_echo_->seq);
+      seq_echo_.reset();
+    }
+    if (!seq_results_.empty() && seq_expired(seq_results_.front())) {
+      seq_timeout(itf, seq_results_.front().seq);
+      seq_results_.pop_front();
+    }
+    if (seq_echo_.has_value() || seq_queue_.empty() ||
+        uart_rx_.above_watermark()) {
+      return;
+    }
+    auto cmd = std::move(seq_queue_.front());
+    seq_queue_.pop_front();
+    cmd_write(cmd.cmd, cmd.host_us);
+    // same budget as cmd_send, plus time spent behind other queued tx
+    cmd.deadline =
+        time_us_32() + (cmd.cmd.size() + 4) * 200 + kSeqEchoSlackUs;
+    seq_echo_ = std::move(cmd);
+  }
+
+  // matches an emc line against the cmds in flight
+  void seq_tag(ResultView* view) {
+    if (seq_echo_.has_value() && view->type_ == kUnknown &&
+        view->response_ == seq_echo_->cmd) {
+      view->seq_ = seq_echo_->seq;
+      seq_echo_->deadline = time_us_32() + kSeqResultTimeoutUs;
+      seq_results_.push_back(std::move(seq_echo_.value()));
+      seq_echo_.reset();
+    } else if (view->is_ok_or_ng()) {
+      if (!seq_results_.empty()) {
+        view->seq_ = seq_results_.front().seq;
+        seq_results_.pop_front();
+      } else if (seq_echo_.has_value()) {
+        // rejected without echo (e.g. rx errors)
+        view->seq_ = seq_echo_->seq;
+        seq_echo_.reset();
+      }
+    }
+  }
+
+  // a special cmd which spans main loop iterations, or an image transfer
+  bool busy() const { return image_active() || cmd_task_.valid(); }
+
+  // Runs a cmd as a Task driven from cdc_process, so usb and efc keep being
+  // serviced. The status frame is sent when it finishes.
+  void cmd_task_start(u8 itf, Task<Result> task) {
+    cmd_task_ = std::move(task);
+    runner_.start(cmd_task_);
+    // may not have needed to wait at all
+    cmd_task_finish(itf);
+  }
+
+  void cmd_task_process(u8 itf) {
+    runner_.poll();
+    if (cmd_task_finish(itf)) {
+      // resume cmd processing with anything host queued meanwhile
+      cdc_rx(itf);
+    }
+  }
+
+  bool cmd_task_finish(u8 itf) {
+    if (!cmd_task_.done()) {
+      return false;
+    }
+    const auto result = std::move(cmd_task_.result());
+    cmd_task_.reset();
+    cdc_write(itf, result);
+    return true;
+  }
+
   void process_cmd(u8 itf, const std::string& cmd) {
-    dbg_println(std::format("host>{}", cmd));
+    dbg_println("host>{}", cmd);
     const auto cmd_type = parse_command_type(cmd);
     if (cmd_type == CommandType::kPassthroughUcmd) {
       // post cmd only - no wait
-      cmd_send(cmd, false);
+      cmd_write(cmd);
     } else if (cmd_type == CommandType::kPassthroughRom) {
       // note we can't have "true" passthrough because we're still line buffered
-      // we used hex encoding to avoid escaping \n
+      // lines are either hex, or binary with \n escaped (see rom_unescape)
       std::vector<u8> buf;
-      if (hex2buf(cmd, &buf)) {
-        uart_.write_blocking(buf.data(), buf.size(), false);
+      const bool valid =
+          cmd.starts_with(kRomLineMarker)
+              ? rom_unescape(std::string_view(cmd).substr(1), &buf)
+              : hex2buf(cmd, &buf);
+      if (valid) {
+        uart_.write(buf.data(), buf.size());
       }
     } else {
       // echo
-      cdc_write(itf, Result::new_unknown(cmd).to_usb_response());
+      cdc_write(itf, Result::new_unknown(cmd));
 
       auto result = Result::new_success();
       switch (cmd_type) {
       case CommandType::kUnlock:
         // autorun takes ~750ms
-        result = autorun();
-        break;
+        cmd_task_start(itf, autorun());
+        return;
       case CommandType::kPicoReset:
         reset_usb_boot(0, 0);
         __builtin_unreachable();
@@ -933,8 +2220,45 @@ struct UcmdClientEmc {
         reset_.reset();
         break;
       case CommandType::kEmcRom:
-        result = rom_enter_exit(cmd);
+        cmd_task_start(itf, rom_enter_exit(cmd));
+        return;
+      case CommandType::kEmcXmodem:
+        result = xmodem_start(cmd);
+        if (image_active()) {
+          // host sends the image once it sees progress. status is sent when
+          // the transfer finishes
+          xmodem_progress(itf);
+          return;
+        }
         break;
+      case CommandType::kEfcBoot:
+        result = efc_boot_start(cmd);
+        if (image_active()) {
+          xmodem_progress(itf);
+          return;
+        }
+        break;
+      case CommandType::kMemRead:
+        cmd_task_start(itf, mem_read(itf, cmd));
+        return;
+      case CommandType::kMemWrite:
+        cmd_task_start(itf, mem_write(itf, cmd));
+        return;
+      case CommandType::kStats:
+        result = stats();
+        break;
+      case CommandType::kLatency:
+        result = latency(itf, cmd);
+        break;
+      case CommandType::kTimestamps:
+        result = set_timestamps(cmd);
+        break;
+      case CommandType::kBackpressure:
+        result = set_backpressure(cmd);
+        break;
+      case CommandType::kBlackBoxDump:
+        cmd_task_start(itf, blackbox(itf, cmd));
+        return;
       case CommandType::kSetFwConsts:
         result = set_fw_consts(cmd);
         break;
@@ -945,12 +2269,12 @@ struct UcmdClientEmc {
         result = Result::new_ng(StatusCode::kUcmdUnknownCmd);
         break;
       }
-      cdc_write(itf, result.to_usb_response());
+      cdc_write(itf, result);
     }
   }
 
   Uart uart_;
-  static Buffer1k uart_rx_;
+  static EmcRxBuffer uart_rx_;
   ChipConsts chip_consts_{salina_consts_};
   bool fw_consts_valid_{};
   FwConstants fw_consts_;
@@ -958,48 +2282,26 @@ struct UcmdClientEmc {
   EmcResetGpio reset_;
   ActiveLowGpio rom_gpio_;
   bool in_rom_{};
+  bool rom_binary_{};
+  bool timestamps_{};
+  static constexpr size_t kHostLineMax{0x1000};
+  // emc echoes cmds back
+  static_assert(kHostLineMax <= EmcRxBuffer::kLineMax);
+  std::string host_line_;
+  bool host_stalled_{};
+  std::deque<SeqCmd> seq_queue_;
+  std::optional<SeqCmd> seq_echo_;
+  std::deque<SeqCmd> seq_results_;
+  XmodemSender xmodem_;
+  u32 xmodem_progress_us_{};
+  TaskRunner runner_;
+  Task<Result> cmd_task_;
+  Efc* efc_{};
+  FrameStats frame_stats_;
+  CmdTracer tracer_;
+  UartBlackBox blackbox_;
 };
-Buffer1k UcmdClientEmc::uart_rx_;
-
-struct Efc {
-  bool init() {
-    uart_rx_.setup_irq(&uart_);
-    if (!uart_.init(1, 460800 /*700000*/, rx_handler)) {
-      return false;
-    }
-    return true;
-  }
-  static void rx_handler() { uart_rx_.uart_rx_handler(); }
-  void cdc_process(u8 itf, u32 max_time_us = 1'000) {
-    cdc_line_coding_t coding{};
-    tud_cdc_n_get_line_coding(itf, &coding);
-    uart_.set_baudrate(coding.bit_rate);
-
-    const u32 start = time_us_32();
-    do {
-      const auto read_avail = static_cast<u32>(uart_rx_.read_available());
-      const u32 write_avail = tud_cdc_n_write_available(itf);
-      const auto xfer_len = std::min(read_avail, write_avail);
-      if (!xfer_len) {
-        break;
-      }
-      std::vector<u8> buf(xfer_len);
-      uart_rx_.read_buf(buf.data(), buf.size());
-      u32 num_written = 0;
-      while (tud_cdc_n_connected(itf) && num_written < xfer_len) {
-        num_written +=
-            tud_cdc_n_write(itf, &buf[num_written], xfer_len - num_written);
-      }
-      if (!tud_cdc_n_connected(itf)) {
-        return;
-      }
-      tud_cdc_n_write_flush(itf);
-    } while (time_us_32() - start < max_time_us);
-  }
-  Uart uart_;
-  static Buffer1k uart_rx_;
-};
-Buffer1k Efc::uart_rx_;
+EmcRxBuffer UcmdClientEmc::uart_rx_;
 
 static constexpr tusb_desc_device_t s_usbd_desc_device = {
     .bLength = sizeof(tusb_desc_device_t),
@@ -1112,42 +2414,93 @@ uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
 static UcmdClientEmc s_emc;
 static Efc s_efc;
 
+// The rings, black boxes and queues above are all static, so an oversized
+// EMC_RX_BUFFER_SIZE/EFC_RX_BUFFER_SIZE/BLACKBOX_SIZE fails here rather than
+// at link time (or worse, by starving the heap). Main sram is 256KiB; the
+// core stacks live in the two 4KiB scratch banks (core1's in scratch x with
+// ENABLE_MULTICORE), so they don't count against it. The rest is left for
+// .data, tinyusb and the heap (Task frames, strings, deques).
+static constexpr size_t kStaticBufferBudget = 192 * 1024;
+static constexpr size_t kStaticBufferSize =
+    sizeof(s_emc) + sizeof(EmcRxBuffer) + sizeof(s_efc) + sizeof(EfcRxBuffer) +
+#ifdef ENABLE_MULTICORE
+    sizeof(s_cdc_queues) +
+#endif
+    sizeof(s_usb_stats) + sizeof(s_loop_stats);
+static_assert(kStaticBufferSize <= kStaticBufferBudget,
+              "rx rings/black boxes don't fit in sram");
+
+// usb -> uart
 // tinyusb already double buffers: first into EP
 // buffer(size=CFG_TUD_CDC_EP_BUFSIZE), then a
 // ringbuffer(CFG_TUD_CDC_RX_BUFSIZE).
-// There is tud_cdc_n_set_wanted_char/tud_cdc_rx_wanted_cb, but the api kinda
-// sucks as you'll have to rescan the fifo for the wanted_char (after tinyusb
-// already scanned). Oh well.
-void tud_cdc_rx_wanted_cb(u8 itf, char wanted_char) {
-  // emc considers \n as end of cmd (configurable). echos input
-  // efc considers \r as end of cmd. echos \r\n for input \r
-
-  // emc interface makes assumption that multiple cmds will not be in tinyusb rx
-  // ringbuffer simultaneously. this sucks but should be fine in practice.
+// emc considers \n as end of cmd (configurable). echos input
+// efc considers \r as end of cmd. echos \r\n for input \r
+// tud_cdc_rx_wanted_cb isn't used for emc: it only fires when the newest packet
+// holds the wanted char, so lines longer than the fifo (binary rom data) would
+// stall, and several lines in one transfer would need a rescan anyway.
+static void cdc_rx(u8 itf) {
+  if (itf == CDC_INTERFACE_EMC) {
+    // emc - line buffer
+    s_emc.cdc_rx(itf);
+    return;
+  }
+  // efc - passthrough
+  if (itf == CDC_INTERFACE_EFC) {
+    s_efc.host_rx(itf);
+  }
+}
 
-  if (itf != CDC_INTERFACE_EMC) {
+#ifdef ENABLE_MULTICORE
+// Set by core1 when it's at a safe point to be locked out for a bootsel read,
+// cleared by core0 once it's done.
+static std::atomic<bool> s_bootsel_poll;
+
+// Reading the bootsel button takes flash away, so core1 has to sit in the
+// lockout handler meanwhile. Only offer that between iterations with no cmd
+// task or image transfer in flight, so it can't stretch a timed uart write.
+static void bootsel_poll_point(u32 now) {
+  static u32 last_poll_us = now;
+  if (now - last_poll_us < 100'000 || s_emc.busy()) {
     return;
   }
-  // emc - line buffer
-  const u32 avail = tud_cdc_n_available(itf);
-  std::string line(avail, '\0');
-  if (tud_cdc_n_read(itf, line.data(), avail) == avail) {
-    line.resize(line.find_first_of(wanted_char));
-    s_emc.process_cmd(itf, line);
+  last_poll_us = now;
+  s_bootsel_poll.store(true, std::memory_order_release);
+  while (s_bootsel_poll.load(std::memory_order_acquire)) {
+    tight_loop_contents();
   }
 }
 
-// efc - passthrough
-void tud_cdc_rx_cb(u8 itf) {
-  if (itf != CDC_INTERFACE_EFC) {
+// core1 owns the uarts (their irqs get installed here) and all protocol state,
+// and only sees usb through s_cdc_queues.
+static void core1_main() {
+  const bool ok = s_emc.init(&s_efc) && s_efc.init();
+  // lets core0 pause us while flash is unavailable (bootsel button read)
+  multicore_lockout_victim_init();
+  multicore_fifo_push_blocking(ok);
+  if (!ok) {
     return;
   }
-  const u32 avail = tud_cdc_n_available(itf);
-  std::vector<u8> buf(avail);
-  if (tud_cdc_n_read(itf, buf.data(), avail) == avail) {
-    s_efc.uart_.write_blocking(buf.data(), avail, false);
+  u32 loop_start = time_us_32();
+  while (true) {
+    for (const u8 itf : {CDC_INTERFACE_EMC, CDC_INTERFACE_EFC}) {
+      if (CdcPort::available(itf)) {
+        cdc_rx(itf);
+      }
+    }
+    s_emc.cdc_process(CDC_INTERFACE_EMC);
+    s_efc.cdc_process(CDC_INTERFACE_EFC);
+
+    bootsel_poll_point(time_us_32());
+
+    const u32 now = time_us_32();
+    s_loop_stats.add(now - loop_start);
+    loop_start = now;
   }
 }
+#else
+void tud_cdc_rx_cb(u8 itf) { cdc_rx(itf); }
+#endif
 
 int main() {
   if (!tusb_init()) {
@@ -1160,16 +2513,37 @@ int main() {
   }
 #endif
 
-  if (!s_emc.init()) {
+#ifdef ENABLE_MULTICORE
+  multicore_launch_core1(core1_main);
+  if (!multicore_fifo_pop_blocking()) {
+    return 1;
+  }
+
+  while (true) {
+    tud_task();
+    s_cdc_queues[CDC_INTERFACE_EMC].pump(CDC_INTERFACE_EMC);
+    s_cdc_queues[CDC_INTERFACE_EFC].pump(CDC_INTERFACE_EFC);
+
+    // core1 asks for this from bootsel_poll_point, where it's safe to stall
+    if (s_bootsel_poll.load(std::memory_order_acquire)) {
+      multicore_lockout_start_blocking();
+      const bool pressed = get_bootsel_button();
+      multicore_lockout_end_blocking();
+      s_bootsel_poll.store(false, std::memory_order_release);
+      if (pressed) {
+        reset_usb_boot(0, 0);
+      }
+    }
+  }
+#else
+  if (!s_emc.init(&s_efc)) {
     return 1;
   }
   if (!s_efc.init()) {
     return 1;
   }
 
-  // setup for emc to use tud_cdc_rx_wanted_cb
-  tud_cdc_n_set_wanted_char(CDC_INTERFACE_EMC, '\n');
-
+  u32 loop_start = time_us_32();
   while (true) {
     // let tinyusb process events
     // will call into the usb -> uart path
@@ -1182,6 +2556,11 @@ int main() {
     if (get_bootsel_button()) {
       reset_usb_boot(0, 0);
     }
+
+    const u32 now = time_us_32();
+    s_loop_stats.add(now - loop_start);
+    loop_start = now;
   }
+#endif
   return 0;
 }
@@ -20,15 +20,18 @@ inline void hexdump(const u8* buf, size_t len) {
 }
 //*/
 
-std::string buf2hex(const std::vector<u8>& buf) {
-  std::string str;
+// |str| must have space for len * 2 chars
+void buf2hex(const u8* buf, size_t len, char* str) {
   static const char lut[] = "0123456789ABCDEF";
-  for (auto& b : buf) {
-    char hi = lut[b >> 4];
-    char lo = lut[b & 0xf];
-    str.push_back(hi);
-    str.push_back(lo);
+  for (size_t i = 0; i < len; i++) {
+    *str++ = lut[buf[i] >> 4];
+    *str++ = lut[buf[i] & 0xf];
   }
+}
+
+std::string buf2hex(const std::vector<u8>& buf) {
+  std::string str(buf.size() * 2, '\0');
+  buf2hex(buf.data(), buf.size(), str.data());
   return str;
 }
 
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <coroutine>
+#include <cstdlib>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include <hardware/timer.h>
+
+#include "types.h"
+
+// Minimal coroutine task, so long running cmds can stay written as straight
+// line code while being driven from the main loop.
+// A Task starts suspended. co_await'ing it runs it to completion (across any
+// number of main loop iterations) and resumes the awaiter with its result.
+// Leaf waits suspend via TaskRunner::yield, and the innermost suspended
+// coroutine is resumed from TaskRunner::poll.
+template <typename T>
+class Task;
+
+namespace task_detail {
+
+struct PromiseBase {
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> handle) noexcept {
+      const auto continuation = handle.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  // built without exceptions
+  void unhandled_exception() { std::abort(); }
+
+  std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  Task<T> get_return_object();
+  void return_value(T value) { value_ = std::move(value); }
+  std::optional<T> value_;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+};
+
+}  // namespace task_detail
+
+template <typename T = void>
+class Task {
+ public:
+  using promise_type = task_detail::Promise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  Task() = default;
+  explicit Task(Handle handle) : handle_(handle) {}
+  Task(Task&& other) : handle_(std::exchange(other.handle_, {})) {}
+  Task& operator=(Task&& other) {
+    if (this != &other) {
+      reset();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() { reset(); }
+
+  bool valid() const { return static_cast<bool>(handle_); }
+  bool done() const { return handle_ && handle_.done(); }
+  // only valid once done()
+  std::add_lvalue_reference_t<T> result()
+    requires(!std::is_void_v<T>)
+  {
+    return *handle_.promise().value_;
+  }
+  void reset() {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+
+  // awaitable
+  bool await_ready() const { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>) {
+      return std::move(*handle_.promise().value_);
+    }
+  }
+
+ private:
+  friend class TaskRunner;
+  Handle handle_;
+};
+
+namespace task_detail {
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+}
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+}
+}  // namespace task_detail
+
+// Drives one top level Task at a time.
+class TaskRunner {
+ public:
+  struct Yield {
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      runner.resume_point_ = handle;
+    }
+    void await_resume() const {}
+    TaskRunner& runner;
+  };
+
+  // suspend the calling coroutine until the next poll()
+  Yield yield() { return {*this}; }
+
+  // suspend until the time has passed
+  Task<> sleep_us(u32 duration_us) {
+    const u32 start = time_us_32();
+    while (time_us_32() - start < duration_us) {
+      co_await yield();
+    }
+  }
+  Task<> sleep_ms(u32 duration_ms) { return sleep_us(duration_ms * 1000); }
+  Task<> sleep_until(absolute_time_t deadline) {
+    while (absolute_time_diff_us(get_absolute_time(), deadline) > 0) {
+      co_await yield();
+    }
+  }
+
+  // runs task until its first suspension
+  template <typename T>
+  void start(Task<T>& task) {
+    resume_point_ = {};
+    task.handle_.resume();
+  }
+  // resumes whatever coroutine last yielded
+  void poll() {
+    if (resume_point_) {
+      std::exchange(resume_point_, {}).resume();
+    }
+  }
+
+ private:
+  std::coroutine_handle<> resume_point_;
+};
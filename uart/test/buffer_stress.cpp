@@ -0,0 +1,188 @@
+// Hammers Buffer from two threads, standing in for the uart rx irq (producer)
+// and the main loop (consumer), and checks every byte and line comes out
+// intact and in order. Prints throughput of each side. Waiting sides yield,
+// so it's still a useful (if slower) test on a single cpu.
+// usage: buffer_stress [megabytes per test]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "buffer.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// emc sized: lines are long enough that the producer never runs out of line
+// slots before the ring fills
+using LineBuffer = Buffer<16384, 16384 / 32>;
+using ByteBuffer = Buffer<32768>;
+constexpr size_t kLineMin = 40;
+
+u8 pattern(size_t pos) { return pos * 131 + (pos >> 9); }
+
+// xorshift, so both threads can make up the same sizes
+struct Rng {
+  u32 next() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+  u32 state;
+};
+
+// "<seq hex8> <filler>:<csum hex2>\n"
+std::string make_line(u32 seq, Rng& rng) {
+  char buf[16];
+  std::snprintf(buf, sizeof(buf), "%08x ", seq);
+  std::string payload = buf;
+  const size_t len = kLineMin + rng.next() % 80;
+  while (payload.size() < len) {
+    payload.push_back('a' + rng.next() % 26);
+  }
+  u8 csum = 0;
+  for (const auto c : payload) {
+    csum += c;
+  }
+  std::snprintf(buf, sizeof(buf), ":%02X\n", csum);
+  return payload + buf;
+}
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <typename... Args>
+bool fail(const char* fmt, Args... args) {
+  std::printf("FAIL: ");
+  std::printf(fmt, args...);
+  std::printf("\n");
+  return false;
+}
+
+// producer push()es a byte at a time like the rx irq, consumer read_line()s
+bool stress_lines(size_t total_bytes) {
+  static LineBuffer buffer;
+  std::atomic<bool> producer_done{};
+  // so the producer doesn't wait forever on a consumer which gave up
+  std::atomic<bool> stop{};
+  size_t num_lines = 0;
+  size_t num_bytes = 0;
+  const auto start = Clock::now();
+  std::thread producer([&] {
+    Rng rng{1};
+    size_t produced = 0;
+    for (u32 seq = 0; produced < total_bytes && !stop; seq++) {
+      const auto line = make_line(seq, rng);
+      for (const auto c : line) {
+        while (!buffer.write_available() && !stop) {
+          std::this_thread::yield();
+        }
+        buffer.push(c);
+      }
+      produced += line.size();
+    }
+    producer_done = true;
+  });
+  bool ok = true;
+  Rng rng{1};
+  std::string line;
+  for (u32 seq = 0; ok && num_bytes < total_bytes; seq++) {
+    const auto expected = make_line(seq, rng);
+    while (!buffer.read_line(&line)) {
+      if (producer_done && !buffer.num_newlines()) {
+        ok = fail("line %u missing", seq);
+        break;
+      }
+      std::this_thread::yield();
+    }
+    // read_line strips ":<csum>\n"
+    if (ok && line != expected.substr(0, expected.size() - 4)) {
+      ok = fail("line %u: got '%s'", seq, line.c_str());
+    }
+    num_lines++;
+    num_bytes += expected.size();
+  }
+  stop = true;
+  producer.join();
+  const double elapsed = seconds_since(start);
+  if (ok && (buffer.num_dropped || buffer.num_bad_lines)) {
+    ok = fail("%zu dropped, %zu bad lines", buffer.num_dropped.load(),
+              buffer.num_bad_lines);
+  }
+  std::printf("lines: %zu lines, %zu bytes in %.3fs: %.2fM push/s, %.2fM "
+              "lines/s\n",
+              num_lines, num_bytes, elapsed, num_bytes / elapsed / 1e6,
+              num_lines / elapsed / 1e6);
+  return ok;
+}
+
+// producer write_buf()s and consumer read_buf()s random sized chunks
+bool stress_bytes(size_t total_bytes) {
+  static ByteBuffer buffer;
+  std::atomic<bool> stop{};
+  size_t num_ops = 0;
+  const auto start = Clock::now();
+  std::thread producer([&] {
+    Rng rng{2};
+    u8 chunk[512];
+    for (size_t pos = 0; pos < total_bytes;) {
+      const size_t len =
+          std::min<size_t>(1 + rng.next() % sizeof(chunk), total_bytes - pos);
+      for (size_t i = 0; i < len; i++) {
+        chunk[i] = pattern(pos + i);
+      }
+      for (size_t done = 0; done < len && !stop;) {
+        const size_t num_written = buffer.write_buf(&chunk[done], len - done);
+        if (!num_written) {
+          std::this_thread::yield();
+        }
+        done += num_written;
+      }
+      pos += len;
+    }
+  });
+  bool ok = true;
+  Rng rng{3};
+  u8 chunk[512];
+  for (size_t pos = 0; pos < total_bytes;) {
+    const size_t num_read =
+        buffer.read_buf(chunk, 1 + rng.next() % sizeof(chunk));
+    if (!num_read) {
+      std::this_thread::yield();
+      continue;
+    }
+    num_ops++;
+    for (size_t i = 0; i < num_read; i++) {
+      if (chunk[i] != pattern(pos + i)) {
+        ok = fail("byte %#zx: got %#x", pos + i, chunk[i]);
+        break;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+    pos += num_read;
+  }
+  stop = true;
+  producer.join();
+  const double elapsed = seconds_since(start);
+  std::printf("bytes: %zu bytes in %.3fs: %.2f MB/s, %.2fM reads/s\n",
+              total_bytes, elapsed, total_bytes / elapsed / 1e6,
+              num_ops / elapsed / 1e6);
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 16;
+  const size_t total_bytes = megabytes << 20;
+  const bool lines_ok = stress_lines(total_bytes);
+  const bool bytes_ok = stress_bytes(total_bytes);
+  return lines_ok && bytes_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
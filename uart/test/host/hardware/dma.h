@@ -0,0 +1,39 @@
+#pragma once
+
+#include "pico/types.h"
+
+enum dma_channel_transfer_size { DMA_SIZE_8, DMA_SIZE_16, DMA_SIZE_32 };
+struct dma_channel_config {
+  uint32_t ctrl;
+};
+struct dma_channel_hw_t {
+  volatile uint32_t read_addr;
+  volatile uint32_t write_addr;
+  volatile uint32_t transfer_count;
+  volatile uint32_t ctrl_trig;
+};
+struct dma_hw_t {
+  dma_channel_hw_t ch[12];
+};
+inline dma_hw_t* dma_hw{};
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_unclaim(uint channel);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config* c,
+                                           dma_channel_transfer_size size);
+void channel_config_set_read_increment(dma_channel_config* c, bool incr);
+void channel_config_set_write_increment(dma_channel_config* c, bool incr);
+void channel_config_set_dreq(dma_channel_config* c, uint dreq);
+void channel_config_set_ring(dma_channel_config* c, bool write,
+                             uint size_bits);
+void dma_channel_configure(uint channel, const dma_channel_config* config,
+                           volatile void* write_addr,
+                           const volatile void* read_addr,
+                           uint32_t transfer_count, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count,
+                                 bool trigger);
+void dma_channel_abort(uint channel);
+void dma_channel_set_irq1_enabled(uint channel, bool enabled);
+bool dma_channel_get_irq1_status(uint channel);
+void dma_channel_acknowledge_irq1(uint channel);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "pico/types.h"
+
+enum gpio_function { GPIO_FUNC_UART = 2 };
+void gpio_set_function(uint gpio, gpio_function fn);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pico/types.h"
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_add_shared_handler(uint num, irq_handler_t handler,
+                            uint8_t order_priority);
+void irq_set_enabled(uint num, bool enabled);
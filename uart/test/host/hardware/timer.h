@@ -0,0 +1,12 @@
+#pragma once
+
+#include <chrono>
+
+#include "pico/types.h"
+
+inline uint64_t time_us_64() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+inline uint32_t time_us_32() { return time_us_64(); }
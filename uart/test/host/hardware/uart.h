@@ -0,0 +1,61 @@
+#pragma once
+
+#include "hardware/irq.h"
+#include "pico/types.h"
+
+struct uart_inst_t;
+struct uart_hw_t {
+  volatile uint32_t dr;
+  volatile uint32_t rsr;
+  uint32_t _pad0[4];
+  volatile uint32_t fr;
+  uint32_t _pad1;
+  volatile uint32_t ilpr;
+  volatile uint32_t ibrd;
+  volatile uint32_t fbrd;
+  volatile uint32_t lcr_h;
+  volatile uint32_t cr;
+  volatile uint32_t ifls;
+  volatile uint32_t imsc;
+  volatile uint32_t ris;
+  volatile uint32_t mis;
+  volatile uint32_t icr;
+  volatile uint32_t dmacr;
+};
+
+#define UART_UARTDR_DATA_BITS 0xff
+#define UART_UARTFR_BUSY_BITS 0x8
+#define UART_UARTIFLS_TXIFLSEL_BITS 0x38
+#define UART_UARTIFLS_TXIFLSEL_LSB 3
+#define UART_UARTIMSC_RXIM_BITS 0x10
+#define UART_UARTIMSC_TXIM_BITS 0x20
+#define UART_UARTIMSC_RTIM_BITS 0x40
+#define UART_UARTIMSC_FEIM_BITS 0x80
+#define UART_UARTIMSC_PEIM_BITS 0x100
+#define UART_UARTIMSC_BEIM_BITS 0x200
+#define UART_UARTIMSC_OEIM_BITS 0x400
+#define UART_UARTMIS_RXMIS_BITS 0x10
+#define UART_UARTMIS_RTMIS_BITS 0x40
+#define UART_UARTMIS_FEMIS_BITS 0x80
+#define UART_UARTMIS_PEMIS_BITS 0x100
+#define UART_UARTMIS_BEMIS_BITS 0x200
+#define UART_UARTMIS_OEMIS_BITS 0x400
+
+uart_inst_t* uart_get_instance(uint num);
+uart_hw_t* uart_get_hw(uart_inst_t* uart);
+uint uart_get_index(uart_inst_t* uart);
+uint uart_init(uart_inst_t* uart, uint baudrate);
+void uart_deinit(uart_inst_t* uart);
+uint uart_set_baudrate(uart_inst_t* uart, uint baudrate);
+void uart_set_irq_enables(uart_inst_t* uart, bool rx_has_data,
+                          bool tx_needs_data);
+bool uart_is_readable(uart_inst_t* uart);
+bool uart_is_writable(uart_inst_t* uart);
+void uart_write_blocking(uart_inst_t* uart, const uint8_t* src, size_t len);
+void uart_tx_wait_blocking(uart_inst_t* uart);
+uint uart_get_dreq(uart_inst_t* uart, bool is_tx);
+
+void hw_set_bits(volatile uint32_t* addr, uint32_t mask);
+void hw_clear_bits(volatile uint32_t* addr, uint32_t mask);
+void hw_write_masked(volatile uint32_t* addr, uint32_t values,
+                     uint32_t write_mask);
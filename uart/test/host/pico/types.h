@@ -0,0 +1,18 @@
+#pragma once
+
+// Just enough of the pico sdk for the ring code to build on a host. Nothing
+// here is meant to be called; only time is implemented.
+
+#include <cstddef>
+#include <cstdint>
+
+typedef unsigned int uint;
+typedef void (*irq_handler_t)(void);
+
+#define NUM_UARTS 2
+#define UART0_IRQ 20
+#define UART1_IRQ 21
+#define DMA_IRQ_1 12
+#define PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY 0x80
+
+inline void tight_loop_contents() {}
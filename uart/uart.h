@@ -1,6 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+
+#include <hardware/dma.h>
 #include <hardware/gpio.h>
+#include <hardware/irq.h>
 #include <hardware/timer.h>
 #include <hardware/uart.h>
 
@@ -38,14 +46,85 @@ class Uart {
     }
     baudrate_ = baudrate;
 
-    const uint irq = (instance == 0) ? UART0_IRQ : UART1_IRQ;
-    irq_set_exclusive_handler(irq, rx_handler);
-    irq_set_enabled(irq, true);
+    // tx irq when the fifo drains to 1/8 full
+    hw_write_masked(&uart_get_hw(uart_)->ifls,
+                    0 << UART_UARTIFLS_TXIFLSEL_LSB,
+                    UART_UARTIFLS_TXIFLSEL_BITS);
+
+    s_uarts_[instance] = this;
+    rx_handler_ = rx_handler;
+    irq_ = (instance == 0) ? UART0_IRQ : UART1_IRQ;
+    irq_set_exclusive_handler(
+        irq_, (instance == 0) ? irq_handler<0> : irq_handler<1>);
+    irq_set_enabled(irq_, true);
     uart_set_irq_enables(uart_, true, false);
+    // only counted. works the same with rx dma, which can't see DR error bits
+    hw_set_bits(&uart_get_hw(uart_)->imsc, kErrorIrqBits);
 
     return true;
   }
 
+  // Switch rx from per-byte irq to a dma channel which streams DR into
+  // |ring|. The ring must be aligned to its size (dma ring wrapping is done on
+  // the low address bits), and size must be a power of 2 <= 32k.
+  bool rx_dma_init(volatile u8* ring, size_t ring_len) {
+    const auto ring_bits = std::countr_zero(ring_len);
+    if (!uart_ || std::popcount(ring_len) != 1 || ring_bits > 15 ||
+        reinterpret_cast<uintptr_t>(ring) & (ring_len - 1)) {
+      return false;
+    }
+    const int chan = dma_claim_unused_channel(false);
+    if (chan < 0) {
+      return false;
+    }
+    rx_irq_enable(false);
+    dma_chan_ = chan;
+    dma_ring_ = ring;
+
+    auto config = dma_channel_get_default_config(dma_chan_);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_ring(&config, true, ring_bits);
+    channel_config_set_dreq(&config, uart_get_dreq(uart_, false));
+    // The count only runs out after ~12 hours at 460800, but rearm it anyway.
+    s_dma_uarts_[uart_get_index(uart_)] = this;
+    dma_count_base_.store(0, std::memory_order_relaxed);
+    dma_channel_set_irq1_enabled(dma_chan_, true);
+    // shared by all uarts
+    if (!s_dma_irq_added_) {
+      irq_add_shared_handler(DMA_IRQ_1, dma_irq_handler,
+                             PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+      irq_set_enabled(DMA_IRQ_1, true);
+      s_dma_irq_added_ = true;
+    }
+    dma_channel_configure(dma_chan_, &config, ring, &uart_get_hw(uart_)->dr,
+                          kDmaTransCount, true);
+    return true;
+  }
+
+  bool rx_dma_enabled() const { return dma_chan_ >= 0; }
+
+  // Position in ring the dma will write next
+  size_t rx_dma_write_pos() const {
+    const auto write_addr = dma_hw->ch[dma_chan_].write_addr;
+    return write_addr - reinterpret_cast<uintptr_t>(dma_ring_);
+  }
+
+  // Free-running count of bytes written by dma (wraps at 32bits)
+  u32 rx_dma_count() const {
+    // Retry if the irq rearmed the channel in between. The irq runs on the
+    // core which called rx_dma_init, as does the reader, so it's atomic here.
+    while (true) {
+      const u32 base = dma_count_base_.load(std::memory_order_acquire);
+      const u32 remaining = dma_hw->ch[dma_chan_].transfer_count;
+      if (base == dma_count_base_.load(std::memory_order_acquire)) {
+        return base + (kDmaTransCount - remaining);
+      }
+    }
+  }
+
+  uint baudrate() const { return baudrate_; }
   void set_baudrate(uint baudrate) {
     if (baudrate_ != baudrate) {
       uart_set_baudrate(uart_, baudrate);
@@ -53,8 +132,14 @@ class Uart {
     }
   }
 
+  // leaves the tx irq alone
   void rx_irq_enable(bool enable) const {
-    uart_set_irq_enables(uart_, enable, false);
+    constexpr u32 rx_bits = UART_UARTIMSC_RXIM_BITS | UART_UARTIMSC_RTIM_BITS;
+    if (enable) {
+      hw_set_bits(&uart_get_hw(uart_)->imsc, rx_bits);
+    } else {
+      hw_clear_bits(&uart_get_hw(uart_)->imsc, rx_bits);
+    }
   }
 
   template <typename T>
@@ -68,36 +153,212 @@ class Uart {
     rx_irq_enable(true);
   }
 
-  void write_blocking(const u8* data, size_t len, bool wait_tx = true) const {
+  // Queues as much of data as fits in the tx ring, which the tx irq feeds into
+  // the fifo. Returns number of bytes queued.
+  size_t try_write(const u8* data, size_t len) {
+    const auto w = tx_wpos_.load(std::memory_order_relaxed);
+    len = std::min(len, write_available());
+    const auto first = std::min(len, tx_ring_.size() - w);
+    std::memcpy(&tx_ring_[w], data, first);
+    std::memcpy(&tx_ring_[0], data + first, len - first);
+    tx_wpos_.store((w + len) & tx_ring_mask_, std::memory_order_release);
+    if (len) {
+      tx_kick();
+    }
+    tx_stats_.tx_bytes += len;
+    tx_stats_.tx_high_water = std::max(tx_stats_.tx_high_water,
+                                       tx_ring_.size() - 1 - write_available());
+    return len;
+  }
+
+  // Queues all of data, only spinning while the tx ring is full.
+  void write(const u8* data, size_t len) {
+    while (len) {
+      const auto num_written = try_write(data, len);
+      data += num_written;
+      len -= num_written;
+    }
+  }
+
+  size_t write_available() const {
+    const auto used = (tx_wpos_.load(std::memory_order_relaxed) -
+                       tx_rpos_.load(std::memory_order_acquire)) &
+                      tx_ring_mask_;
+    return tx_ring_.size() - 1 - used;
+  }
+
+  // bytes in the tx ring, not counting the fifo
+  size_t tx_queued() const { return tx_ring_.size() - 1 - write_available(); }
+
+  // anything queued or still on the wire
+  bool tx_busy() const {
+    return tx_rpos_.load(std::memory_order_acquire) !=
+               tx_wpos_.load(std::memory_order_relaxed) ||
+           (uart_get_hw(uart_)->fr & UART_UARTFR_BUSY_BITS);
+  }
+
+  // Bypasses the tx ring (after draining it) for when timing matters: returns
+  // once data is in the fifo, or with wait_tx, once it's on the wire.
+  void write_blocking(const u8* data, size_t len, bool wait_tx = true) {
+    wait_tx_ring_empty();
     // Note this waits until data is sent to uart - not until tx fifo is drained
     uart_write_blocking(uart_, data, len);
+    tx_stats_.tx_bytes += len;
     if (wait_tx) {
       // Wait for data to be sent on wire
       uart_tx_wait_blocking(uart_);
     }
   }
 
+  // Spins until everything queued is on the wire.
+  void flush_blocking() {
+    wait_tx_ring_empty();
+    uart_tx_wait_blocking(uart_);
+  }
+
+  // counted in the uart irq
+  struct ErrorCounts {
+    std::atomic<u32> framing;
+    std::atomic<u32> parity;
+    std::atomic<u32> brk;
+    std::atomic<u32> overrun;
+  };
+  // tx side, counted by the writer
+  struct TxStats {
+    u32 tx_bytes;
+    // most bytes ever queued in the tx ring
+    size_t tx_high_water;
+  };
+  const ErrorCounts& errors() const { return errors_; }
+  const TxStats& tx_stats() const { return tx_stats_; }
+
  private:
   void deinit() {
+    if (uart_) {
+      irq_set_enabled(irq_, false);
+      s_uarts_[uart_get_index(uart_)] = {};
+    }
+    if (rx_dma_enabled()) {
+      dma_channel_set_irq1_enabled(dma_chan_, false);
+      dma_channel_abort(dma_chan_);
+      dma_channel_unclaim(dma_chan_);
+      s_dma_uarts_[uart_get_index(uart_)] = {};
+      dma_chan_ = -1;
+    }
     if (uart_) {
       uart_deinit(uart_);
       uart_ = {};
     }
   }
 
+  // error bits are counted from the error irqs instead (see count_errors)
   u8 read_dr() const {
-    const auto dr = uart_get_hw(uart_)->dr;
-    /*
-    constexpr u32 err_bits = UART_UARTDR_FE_BITS | UART_UARTDR_PE_BITS |
-                             UART_UARTDR_BE_BITS | UART_UARTDR_OE_BITS;
-    const auto dr_err = dr & err_bits;
-    if (dr_err) {
-      printf("read_dr err %lx\n", dr_err);
+    return uart_get_hw(uart_)->dr & UART_UARTDR_DATA_BITS;
+  }
+
+  template <uint Instance>
+  static void irq_handler() {
+    auto uart = s_uarts_[Instance];
+    const u32 mis = uart_get_hw(uart->uart_)->mis;
+    constexpr u32 rx_bits = UART_UARTMIS_RXMIS_BITS | UART_UARTMIS_RTMIS_BITS;
+    // with rx dma, DR must be left to the dma
+    if (mis & rx_bits) {
+      uart->rx_handler_();
     }
-    //*/
-    return dr & UART_UARTDR_DATA_BITS;
+    if (mis & kErrorIrqBits) {
+      uart->count_errors(mis);
+    }
+    uart->tx_fill();
   }
 
+  void count_errors(u32 mis) {
+    const auto bump = [](std::atomic<u32>& counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    };
+    if (mis & UART_UARTMIS_FEMIS_BITS) {
+      bump(errors_.framing);
+    }
+    if (mis & UART_UARTMIS_PEMIS_BITS) {
+      bump(errors_.parity);
+    }
+    if (mis & UART_UARTMIS_BEMIS_BITS) {
+      bump(errors_.brk);
+    }
+    if (mis & UART_UARTMIS_OEMIS_BITS) {
+      bump(errors_.overrun);
+    }
+    uart_get_hw(uart_)->icr = mis & kErrorIrqBits;
+  }
+
+  // tx ring consumer. runs in the irq, or with the irq masked.
+  void tx_fill() {
+    auto r = tx_rpos_.load(std::memory_order_relaxed);
+    const auto w = tx_wpos_.load(std::memory_order_acquire);
+    while (r != w && uart_is_writable(uart_)) {
+      uart_get_hw(uart_)->dr = tx_ring_[r];
+      r = (r + 1) & tx_ring_mask_;
+    }
+    tx_rpos_.store(r, std::memory_order_release);
+    // The irq fires when the fifo drains past the trigger level, so it's only
+    // wanted while the ring (and therefore the fifo) isn't empty.
+    if (r != w) {
+      hw_set_bits(&uart_get_hw(uart_)->imsc, UART_UARTIMSC_TXIM_BITS);
+    } else {
+      hw_clear_bits(&uart_get_hw(uart_)->imsc, UART_UARTIMSC_TXIM_BITS);
+    }
+  }
+
+  void wait_tx_ring_empty() const {
+    while (tx_rpos_.load(std::memory_order_acquire) !=
+           tx_wpos_.load(std::memory_order_relaxed)) {
+      tight_loop_contents();
+    }
+  }
+
+  // An idle fifo never raises the tx irq, so the producer has to start it.
+  void tx_kick() {
+    irq_set_enabled(irq_, false);
+    tx_fill();
+    irq_set_enabled(irq_, true);
+  }
+
+  static void dma_irq_handler() {
+    for (auto uart : s_dma_uarts_) {
+      if (!uart || !dma_channel_get_irq1_status(uart->dma_chan_)) {
+        continue;
+      }
+      dma_channel_acknowledge_irq1(uart->dma_chan_);
+      // write_addr is left where it stopped, so the ring just continues
+      dma_channel_set_trans_count(uart->dma_chan_, kDmaTransCount, true);
+      uart->dma_count_base_.store(
+          uart->dma_count_base_.load(std::memory_order_relaxed) +
+              kDmaTransCount,
+          std::memory_order_release);
+    }
+  }
+
+  // a power of 2, so the count carries on exactly across rearms
+  static constexpr u32 kDmaTransCount{1u << 31};
+  static inline Uart* s_dma_uarts_[NUM_UARTS]{};
+  static inline bool s_dma_irq_added_{};
+  static inline Uart* s_uarts_[NUM_UARTS]{};
+  static constexpr size_t tx_ring_mask_{1024 - 1};
+  static constexpr u32 kErrorIrqBits =
+      UART_UARTIMSC_FEIM_BITS | UART_UARTIMSC_PEIM_BITS |
+      UART_UARTIMSC_BEIM_BITS | UART_UARTIMSC_OEIM_BITS;
+
   uart_inst_t* uart_{};
   uint baudrate_{};
+  uint irq_{};
+  irq_handler_t rx_handler_{};
+  std::array<u8, tx_ring_mask_ + 1> tx_ring_{};
+  std::atomic<size_t> tx_wpos_{};
+  std::atomic<size_t> tx_rpos_{};
+  ErrorCounts errors_{};
+  TxStats tx_stats_{};
+  int dma_chan_{-1};
+  volatile u8* dma_ring_{};
+  // bytes of the runs before the current one. written by the dma irq
+  std::atomic<u32> dma_count_base_{};
 };
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include <hardware/timer.h>
+
+#include "types.h"
+
+// XMODEM / XMODEM-1K sender, polled from the main loop so usb keeps being
+// serviced during the transfer.
+// The image isn't buffered: each block is pulled from Io::read_data right
+// before it's sent, so the host is throttled by usb flow control. If the host
+// stops sending for kHostDataTimeoutUs, the receiver is cancelled too.
+// Io must provide:
+//  size_t read_data(u8* buf, size_t len);  // image bytes from host
+//  bool read_byte(u8* b);                  // bytes from receiver
+//  void write(const u8* buf, size_t len);  // bytes to receiver
+class XmodemSender {
+ public:
+  enum Status {
+    kBusy,
+    kDone,
+    kNoStart,
+    kCancelled,
+    kRetriesExceeded,
+    // the host stopped sending image data
+    kHostTimeout,
+  };
+
+  // short_tail: send the last block as 128 bytes if it fits, for receivers
+  // which handle mixed block sizes
+  void start(u32 size, bool use_1k, bool short_tail = true) {
+    size_ = size;
+    data_pos_ = 0;
+    num_sent_ = 0;
+    use_1k_ = use_1k;
+    short_tail_ = short_tail;
+    use_crc_ = false;
+    seq_ = 1;
+    block_len_ = 0;
+    retries_ = 0;
+    result_ = kBusy;
+    state_ = kWaitStart;
+    deadline_ = time_us_32() + kStartTimeoutUs;
+  }
+
+  // gives up on the transfer, e.g. when the receiver reported an error out of
+  // band. nothing is sent to the receiver
+  void cancel() {
+    if (state_ != kIdle && state_ != kDrain) {
+      fail(kCancelled);
+    }
+  }
+
+  bool active() const { return state_ != kIdle; }
+  u32 size() const { return size_; }
+  // image bytes acked by the receiver
+  u32 num_sent() const { return num_sent_; }
+
+  template <typename Io>
+  Status poll(Io& io) {
+    switch (state_) {
+    case kIdle:
+      return result_;
+    case kWaitStart: {
+      u8 b;
+      while (io.read_byte(&b)) {
+        if (b == kCrcStart || b == kNak) {
+          use_crc_ = b == kCrcStart;
+          state_ = kFillBlock;
+          host_wait_start();
+          break;
+        } else if (b == kCan) {
+          return fail(kCancelled);
+        }
+      }
+      if (state_ == kWaitStart) {
+        if (expired()) {
+          return fail(kNoStart);
+        }
+        break;
+      }
+    }
+      [[fallthrough]];
+    case kFillBlock:
+      if (!fill_block(io)) {
+        if (host_expired()) {
+          return host_timeout(io);
+        }
+        break;
+      }
+      if (!block_len_) {
+        send_eot(io);
+        break;
+      }
+      build_packet();
+      send_packet(io);
+      break;
+    case kWaitAck:
+    case kWaitEotAck: {
+      u8 b;
+      while (io.read_byte(&b)) {
+        if (b == kAck) {
+          retries_ = 0;
+          if (state_ == kWaitEotAck) {
+            state_ = kIdle;
+            result_ = kDone;
+            return result_;
+          }
+          num_sent_ += block_len_;
+          block_len_ = 0;
+          seq_++;
+          state_ = kFillBlock;
+          host_wait_start();
+          return kBusy;
+        } else if (b == kNak) {
+          return resend(io);
+        } else if (b == kCan) {
+          return fail(kCancelled);
+        }
+        // anything else is line noise
+      }
+      if (expired()) {
+        return resend(io);
+      }
+    } break;
+    case kDrain:
+      drain(io);
+      break;
+    }
+    return state_ == kIdle ? result_ : kBusy;
+  }
+
+ private:
+  enum State {
+    kIdle,
+    kWaitStart,
+    kFillBlock,
+    kWaitAck,
+    kWaitEotAck,
+    kDrain,
+  };
+
+  static constexpr u8 kSoh = 0x01;
+  static constexpr u8 kStx = 0x02;
+  static constexpr u8 kEot = 0x04;
+  static constexpr u8 kAck = 0x06;
+  static constexpr u8 kNak = 0x15;
+  static constexpr u8 kCan = 0x18;
+  static constexpr u8 kCrcStart = 'C';
+  static constexpr u8 kPad = 0x1a;
+  static constexpr size_t kBlockLen = 128;
+  static constexpr size_t kBlockLen1k = 1024;
+  static constexpr u32 kStartTimeoutUs = 10'000'000;
+  static constexpr u32 kAckTimeoutUs = 1'000'000;
+  static constexpr u32 kMaxRetries = 10;
+  // max gap in image data from host
+  static constexpr u32 kHostDataTimeoutUs = 1'000'000;
+
+  static u16 crc16(const u8* buf, size_t len) {
+    u16 crc = 0;
+    for (size_t i = 0; i < len; i++) {
+      crc ^= buf[i] << 8;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+      }
+    }
+    return crc;
+  }
+
+  bool expired() const {
+    return static_cast<s32>(time_us_32() - deadline_) >= 0;
+  }
+  void host_wait_start() {
+    host_deadline_ = time_us_32() + kHostDataTimeoutUs;
+  }
+  bool host_expired() const {
+    return static_cast<s32>(time_us_32() - host_deadline_) >= 0;
+  }
+
+  // 1k blocks need crc
+  size_t block_capacity() const {
+    if (!use_1k_ || !use_crc_) {
+      return kBlockLen;
+    }
+    const u32 remaining = size_ - num_sent_;
+    return (short_tail_ && remaining <= kBlockLen) ? kBlockLen : kBlockLen1k;
+  }
+
+  // returns true once the block is complete (or the image is exhausted)
+  template <typename Io>
+  bool fill_block(Io& io) {
+    const size_t capacity = block_capacity();
+    const size_t want =
+        std::min<size_t>(capacity, size_ - num_sent_) - block_len_;
+    if (want) {
+      const size_t num_read = io.read_data(&packet_[3 + block_len_], want);
+      block_len_ += num_read;
+      data_pos_ += num_read;
+      if (num_read) {
+        host_wait_start();
+      }
+      if (num_read < want) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void build_packet() {
+    const size_t capacity = block_capacity();
+    packet_[0] = capacity == kBlockLen1k ? kStx : kSoh;
+    packet_[1] = seq_;
+    packet_[2] = ~seq_;
+    u8* data = &packet_[3];
+    std::memset(&data[block_len_], kPad, capacity - block_len_);
+    if (use_crc_) {
+      const u16 crc = crc16(data, capacity);
+      data[capacity] = crc >> 8;
+      data[capacity + 1] = crc;
+      packet_len_ = 3 + capacity + 2;
+    } else {
+      u8 csum = 0;
+      for (size_t i = 0; i < capacity; i++) {
+        csum += data[i];
+      }
+      data[capacity] = csum;
+      packet_len_ = 3 + capacity + 1;
+    }
+  }
+
+  template <typename Io>
+  void send_packet(Io& io) {
+    io.write(packet_.data(), packet_len_);
+    state_ = kWaitAck;
+    deadline_ = time_us_32() + kAckTimeoutUs;
+  }
+
+  template <typename Io>
+  void send_eot(Io& io) {
+    const u8 eot = kEot;
+    io.write(&eot, 1);
+    state_ = kWaitEotAck;
+    deadline_ = time_us_32() + kAckTimeoutUs;
+  }
+
+  template <typename Io>
+  Status resend(Io& io) {
+    if (++retries_ > kMaxRetries) {
+      return fail(kRetriesExceeded);
+    }
+    if (state_ == kWaitEotAck) {
+      send_eot(io);
+    } else {
+      send_packet(io);
+    }
+    return kBusy;
+  }
+
+  // the host is still streaming the image, so swallow the rest of it before
+  // reporting failure
+  Status fail(Status status) {
+    result_ = status;
+    state_ = kDrain;
+    host_wait_start();
+    return kBusy;
+  }
+
+  // without the rest of the image the transfer can't complete, so tell the
+  // receiver to give up too
+  template <typename Io>
+  Status host_timeout(Io& io) {
+    const u8 cancel[]{kCan, kCan};
+    io.write(cancel, sizeof(cancel));
+    result_ = kHostTimeout;
+    state_ = kIdle;
+    return result_;
+  }
+
+  template <typename Io>
+  void drain(Io& io) {
+    while (data_pos_ < size_) {
+      const size_t want = std::min<size_t>(size_ - data_pos_, kBlockLen1k);
+      const size_t num_read = io.read_data(&packet_[3], want);
+      data_pos_ += num_read;
+      if (num_read) {
+        host_wait_start();
+      }
+      if (num_read < want) {
+        // the host gave up too. the failure is already in result_
+        if (host_expired()) {
+          state_ = kIdle;
+        }
+        return;
+      }
+    }
+    state_ = kIdle;
+  }
+
+  State state_{kIdle};
+  Status result_{kBusy};
+  u32 size_{};
+  // image bytes pulled from host
+  u32 data_pos_{};
+  u32 num_sent_{};
+  bool use_1k_{};
+  bool short_tail_{};
+  bool use_crc_{};
+  u8 seq_{};
+  size_t block_len_{};
+  size_t packet_len_{};
+  u32 retries_{};
+  u32 deadline_{};
+  u32 host_deadline_{};
+  std::array<u8, 3 + kBlockLen1k + 2> packet_{};
+};
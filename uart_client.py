@@ -1,5 +1,5 @@
 #!/usr/bin/env python3
-import struct, time
+import struct, time, zlib
 from hexdump2 import hexdump
 import serial
 import hashlib
@@ -156,6 +156,41 @@ STATUS_MAP.update([(255 + i, val) for i, val in enumerate(STATUS_NAMES)])
 
 x = STATUS_NAMES[0x124-255]
 
+def lz4_block_decompress(src: bytes, size: int) -> bytes:
+    # plain lz4 block format, as uart_shell's Lz4 produces
+    dst = bytearray()
+    i = 0
+    while i < len(src):
+        token = src[i]
+        i += 1
+        literal_len = token >> 4
+        if literal_len == 15:
+            while True:
+                literal_len += src[i]
+                i += 1
+                if src[i - 1] != 255: break
+        dst += src[i:i + literal_len]
+        i += literal_len
+        if i >= len(src):
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        match_len = token & 15
+        if match_len == 15:
+            while True:
+                match_len += src[i]
+                i += 1
+                if src[i - 1] != 255: break
+        match_len += 4
+        if offset == 0 or offset > len(dst):
+            raise ValueError('bad lz4 offset')
+        match = dst[len(dst) - offset:]
+        # overlapping matches repeat the last offset bytes
+        dst += (match * (match_len // offset + 1))[:match_len]
+    if len(dst) != size:
+        raise ValueError('bad lz4 size')
+    return bytes(dst)
+
 def dump_path(name):
     path = Path(__file__).parent.joinpath('dumps')
     path.mkdir(parents=True, exist_ok=True)
@@ -179,6 +214,30 @@ class Client:
     CMD_INT_DISABLE = 4
     CMD_INT_ENABLE = 5
     CMD_DABORT_STATUS = 6
+    CMD_UART_CONFIG = 7
+    CMD_DUMP_BENCH = 8
+    CMD_UART_BAUD = 9
+    CMD_MEM_XFER = 10
+    CMD_MEM_READ_LZ4 = 11
+    CMD_MEM_HASH = 12
+    CMD_MEM_FILL = 13
+    CMD_MEM_COPY = 14
+    CMD_MEM_CMP = 15
+
+    # the uart the shell talks on
+    UART_BASE = 0x11010000
+    BAUD_MAGIC = 0x5a5aa5a5
+    # reg0, reg1 and reg3 of the shell's uart are rx, tx and status
+    UART_IO_REGS = (0, 1, 3)
+    # refuse rates the integer divisor can't hit within this
+    BAUD_MAX_ERROR = 0.02
+    XFER_END = 0xffffffff
+    XFER_OK = 0
+    HASH_CRC32 = 0
+    HASH_SHA256 = 1
+
+    # the shell's own image, always readable
+    SHELL_BASE = 0x58000000
 
     def __init__(self, port, baudrate=230400*2):
         self.port = serial.Serial(port, baudrate=baudrate, timeout=1)
@@ -255,6 +314,251 @@ class Client:
         }.get(src, 'unknown')
         print(f'DABORT {dfar:08x} {dfsr:08x} {access} {src_name}')
 
+    def uart_config(self, tx_burst):
+        # returns the previous tx burst len
+        self._write32(self.CMD_UART_CONFIG)
+        self._write32(tx_burst)
+        return self._read32()
+
+    # the shell clamps tx bursts to this (Uart::kFifoMax)
+    UART_FIFO_MAX = 16
+
+    def uart_probe_fifo(self, addr=SHELL_BASE, size=0x1000, passes=3):
+        # The shell can't read the fifo depth from hw, so find the largest tx
+        # burst that doesn't lose bytes. A burst is only kept if every pass
+        # comes back intact; otherwise the shell is left at 1.
+        self.uart_config(1)
+        ref = self.read(addr, size)
+        for tx_burst in (self.UART_FIFO_MAX, 8, 4, 2):
+            self.uart_config(tx_burst)
+            for _ in range(passes):
+                self._write_mem_access(addr, size, 1, 0)
+                if self.port.read(size) != ref:
+                    break
+            else:
+                return tx_burst
+            # lost bytes: the shell is done sending, just short
+            self.port.reset_input_buffer()
+            self.uart_config(1)
+        return 1
+
+    def uart_set_baudrate(self, baudrate, div_reg):
+        # div_reg: word index of the baud divisor among the shell's uart regs
+        # (Uart::Regs in uart_shell.cpp). Which one it is hasn't been confirmed
+        # on hardware, so there's no default: a wrong guess writes into an
+        # unknown control reg.
+        # The divisor is assumed to be a plain integer (rate = clock / div) with
+        # no fractional field, and is scaled from its current value as
+        # round(old_div * old_baud / baud), taking the current rate to be
+        # self.port.baudrate. The pico follows the port's line coding.
+        if div_reg in self.UART_IO_REGS:
+            raise ValueError(f'reg{div_reg} is a uart io reg')
+        old_baudrate = self.port.baudrate
+        old_div = self.read32(self.UART_BASE + div_reg * 4)
+        div = round(old_div * old_baudrate / baudrate)
+        if not div or abs(old_div * old_baudrate / div / baudrate - 1) > self.BAUD_MAX_ERROR:
+            raise ValueError(f'{baudrate} not reachable from div {old_div:#x} at {old_baudrate}')
+        self._write32(self.CMD_UART_BAUD)
+        self.port.write(struct.pack('<2I', div_reg, div))
+        if self._read32() != old_div:
+            return False
+        self.port.baudrate = baudrate
+        self.port.reset_input_buffer()
+        self._write32(self.BAUD_MAGIC)
+        if self.port.read(4) == struct.pack('<I', self.BAUD_MAGIC + 1):
+            self._write32(self.BAUD_MAGIC + 2)
+            # If magic+2 arrived the shell stays at the new rate for good, so
+            # a lost byte (or the pico still switching its line coding) must
+            # not send us back to the old rate.
+            if self._ping_retry(5):
+                return True
+        # Either the handshake failed, and the shell restores the old divisor
+        # once it times out, or magic+2 never arrived, which ends the same way.
+        self.port.baudrate = old_baudrate
+        if not self._ping_retry(10):
+            raise IOError(f'shell lost at both {baudrate} and {old_baudrate}')
+        return False
+
+    def _ping_retry(self, tries):
+        for _ in range(tries):
+            # long enough for the shell to give up on a partial cmd
+            time.sleep(.5)
+            self.port.reset_input_buffer()
+            try:
+                if self.ping(): return True
+            except: pass
+        return False
+
+    def _xfer_start(self, addr, size, block_size, stride, is_write, cmd=CMD_MEM_XFER, hash_type=0):
+        req = struct.pack('<3I3Bx', addr, size, block_size, stride, is_write, hash_type)
+        self._write32(cmd)
+        self.port.write(req + struct.pack('<I', zlib.crc32(req)))
+        status = self.port.read(4)
+        if status != struct.pack('<I', self.XFER_OK):
+            raise IOError(f'xfer start failed: {status.hex()}')
+
+    def _xfer_resync(self):
+        # let the rest of a bad frame arrive before tossing it
+        time.sleep(.05)
+        self.port.reset_input_buffer()
+
+    def read_blocks(self, addr, size, block_size=0x400, stride=1, retries=8):
+        # like read(), but each block is crc checked and retried
+        self._xfer_start(addr, size, block_size, stride, 0)
+        data = bytearray()
+        try:
+            for seq in range(0, (size + block_size - 1) // block_size):
+                block_len = min(block_size, size - seq * block_size)
+                for _ in range(retries):
+                    self.port.write(struct.pack('<2I', seq, seq ^ 0xffffffff))
+                    frame = self.port.read(8 + block_len + 4)
+                    if len(frame) == 8 + block_len + 4 and \
+                            struct.unpack_from('<2I', frame) == (seq, block_len) and \
+                            struct.unpack_from('<I', frame, 8 + block_len)[0] == zlib.crc32(frame[:-4]):
+                        data += frame[8:-4]
+                        break
+                    self._xfer_resync()
+                else:
+                    raise IOError(f'block {seq} failed')
+        finally:
+            self.port.write(struct.pack('<2I', self.XFER_END, 0))
+        return bytes(data)
+
+    def read_compressed(self, addr, size, block_size=0x10000, retries=8):
+        # like read_blocks, but blocks are lz4 compressed on the target. Not
+        # for registers: memory is read bytewise, more than once.
+        self._xfer_start(addr, size, block_size, 1, 0, self.CMD_MEM_READ_LZ4)
+        data = bytearray()
+        try:
+            for seq in range(0, (size + block_size - 1) // block_size):
+                block_len = min(block_size, size - seq * block_size)
+                for _ in range(retries):
+                    self.port.write(struct.pack('<2I', seq, seq ^ 0xffffffff))
+                    hdr = self.port.read(12)
+                    if len(hdr) == 12:
+                        hdr_seq, hdr_len, comp_len = struct.unpack('<3I', hdr)
+                        # lz4 worst case is a bit over the raw size
+                        if (hdr_seq, hdr_len) == (seq, block_len) and \
+                                comp_len <= block_len + block_len // 255 + 16:
+                            body = self.port.read(comp_len + 4)
+                            if len(body) == comp_len + 4 and \
+                                    struct.unpack_from('<I', body, comp_len)[0] == zlib.crc32(hdr + body[:-4]):
+                                data += lz4_block_decompress(body[:-4], block_len)
+                                break
+                    self._xfer_resync()
+                else:
+                    raise IOError(f'block {seq} failed')
+        finally:
+            self.port.write(struct.pack('<2I', self.XFER_END, 0))
+        return bytes(data)
+
+    def write_blocks(self, addr, data, block_size=0x400, stride=1, retries=8):
+        size = len(data)
+        self._xfer_start(addr, size, block_size, stride, 1)
+        try:
+            for seq in range(0, (size + block_size - 1) // block_size):
+                block = data[seq * block_size:(seq + 1) * block_size]
+                frame = struct.pack('<2I', seq, len(block)) + block
+                frame += struct.pack('<I', zlib.crc32(frame))
+                for _ in range(retries):
+                    self.port.write(frame)
+                    if self.port.read(8) == struct.pack('<2I', seq, self.XFER_OK):
+                        break
+                    self._xfer_resync()
+                else:
+                    raise IOError(f'block {seq} failed')
+        finally:
+            self.port.write(struct.pack('<2I', self.XFER_END, 0))
+
+    def mem_hash(self, addr, size, block_size=None, stride=1, hash_type=HASH_CRC32):
+        # digest per block, or one for the whole range
+        if block_size is None:
+            block_size = size
+        digest_len = 32 if hash_type == self.HASH_SHA256 else 4
+        num_blocks = (size + block_size - 1) // block_size
+        self._xfer_start(addr, size, block_size, stride, 0, self.CMD_MEM_HASH, hash_type)
+        timeout = self.port.timeout
+        # the target hashes a block before sending its digest
+        self.port.timeout = block_size / 0x100000 + 1
+        try:
+            digests = [self.port.read(digest_len) for _ in range(num_blocks)]
+            crc = self.port.read(4)
+        finally:
+            self.port.timeout = timeout
+        reply = b''.join(digests)
+        if len(reply) != num_blocks * digest_len or len(crc) != 4 or \
+                struct.unpack('<I', crc)[0] != zlib.crc32(reply):
+            raise IOError('hash reply corrupt')
+        if hash_type == self.HASH_CRC32:
+            return [struct.unpack('<I', d)[0] for d in digests]
+        return digests
+
+    def verify(self, addr, data, stride=1, sha256=False):
+        if sha256:
+            expected = hashlib.sha256(data).digest()
+            return self.mem_hash(addr, len(data), stride=stride, hash_type=self.HASH_SHA256)[0] == expected
+        return self.mem_hash(addr, len(data), stride=stride)[0] == zlib.crc32(data)
+
+    def sync(self, addr, size, cached=None, block_size=0x1000, stride=1):
+        # refetches only the blocks that differ from cached (a previous dump)
+        if cached is None or len(cached) != size:
+            return self.read_blocks(addr, size, stride=stride)
+        data = bytearray(cached)
+        crcs = self.mem_hash(addr, size, block_size, stride)
+        seq = 0
+        while seq < len(crcs):
+            offset = seq * block_size
+            if crcs[seq] == zlib.crc32(data[offset:offset + block_size]):
+                seq += 1
+                continue
+            # fetch runs of changed blocks in one go
+            end = seq + 1
+            while end < len(crcs) and crcs[end] != zlib.crc32(data[end * block_size:(end + 1) * block_size]):
+                end += 1
+            run_len = min(end * block_size, size) - offset
+            data[offset:offset + run_len] = self.read_blocks(addr + offset, run_len, stride=stride)
+            seq = end
+        return bytes(data)
+
+    def _mem_op(self, cmd, fmt, *args, size):
+        # runs on target, replies once done
+        self._write32(cmd)
+        self.port.write(struct.pack(fmt, *args))
+        timeout = self.port.timeout
+        self.port.timeout = size / 0x100000 + 1
+        try:
+            return self._read32()
+        finally:
+            self.port.timeout = timeout
+
+    def fill(self, addr, size, pattern=0, width=1):
+        # pattern is width (1, 2 or 4) bytes
+        if self._mem_op(self.CMD_MEM_FILL, '<4I', addr, size, pattern, width, size=size) != 0:
+            raise ValueError('bad fill args')
+
+    def copy(self, dst, src, size):
+        self._mem_op(self.CMD_MEM_COPY, '<3I', dst, src, size, size=size)
+
+    def compare(self, addr_a, addr_b, size):
+        # offset of the first mismatch, None if equal
+        offset = self._mem_op(self.CMD_MEM_CMP, '<3I', addr_a, addr_b, size, size=size)
+        return None if offset == 0xffffffff else offset
+
+    def dump_bench(self, addr=SHELL_BASE, size=0x10000):
+        self._write32(self.CMD_DUMP_BENCH)
+        self.port.write(struct.pack('<2I', addr, size))
+        timeout = self.port.timeout
+        self.port.timeout = size * 10 / self.port.baudrate + 1
+        start = time.monotonic()
+        data = self.port.read(size)
+        cycles = self._read32() * 64
+        elapsed = time.monotonic() - start
+        self.port.timeout = timeout
+        assert len(data) == size
+        print(f'{size:#x} bytes in {elapsed:.3f}s: {size / elapsed:.0f} bytes/sec '
+              f'({cycles / size:.1f} cpu cycles/byte)')
+        return size / elapsed
+
     def debug_reset(self):
         self.reg_write(Reg.DBGPRCR, 2)
 
@@ -303,16 +607,16 @@ class Client:
             old = vals
             vals = []
             for i in range(0, len(old), stride):
-                vals.append(struct.unpack_from('<I', old, i)[0])
+                vals.append(struct.unpack_from(fmt, old, i)[0])
         self._write_mem_access(addr, len(vals), stride, 1)
         for val in vals: self._write_fmt(fmt, val)
         #self.check_dabort()
 
     def read8(self, addr): return self.read_fmt(addr, '<B')
-    #def read16(self, addr): return self.read_fmt(addr, '<H')
+    def read16(self, addr): return self.read_fmt(addr, '<H')
     def read32(self, addr): return self.read_fmt(addr, '<I')
     def write8(self, addr, val): self.write_fmt(addr, '<B', val)
-    #def write16(self, addr, val): self.write_fmt(addr, '<H', val)
+    def write16(self, addr, val): self.write_fmt(addr, '<H', val)
     def write32(self, addr, val): self.write_fmt(addr, '<I', val)
 
     def read(self, addr, size):
@@ -565,8 +869,7 @@ class Client:
         # it seems to only ever return "07 07 00 01 00 00 00 00"
         # no longer takes index
         dst = 0x1000
-        pattern = 0xdeadbeef.to_bytes(4, 'little')
-        self.write(dst, pattern * (0x1000//4))
+        self.fill(dst, 0x1000, 0xdeadbeef, 4)
         rv = self.bcm_cmd(32, dst, index, index, index, index)
         if rv != 0:
             print(f'otp_read error {rv} {STATUS_MAP.get(rv)}')
@@ -602,7 +905,7 @@ class Client:
     def aes_test(self):
         buf_addr = 0x100
         buf_len = 0x100
-        self.write(buf_addr, b'\x00' * buf_len)
+        self.fill(buf_addr, buf_len)
 
         key_bitlen = 128
         engine = 2
@@ -637,7 +940,7 @@ class Client:
         #self.write(src, bytes([2]) * aligned_size)
         buf = b''.join([(0xaabb0000+x).to_bytes(4, 'little') for x in range(num_dwords)])
         self.write(src, buf)
-        self.write(dst, b'\0' * aligned_size)
+        self.fill(dst, aligned_size)
         #print('src')
         #hexdump(self.read(src, 0x1000))
         self.bcm_cmd(56, 0, 0, num_dwords, src, dst)